@@ -1,180 +1,1295 @@
 #include "interface.h"
 #include "my_memory.h"
+#include "my_allocator.h"
 
 // Interface implementation
 // Implement APIs here...
 
 // Global Data
-enum malloc_type policy;
-BUDDYTREE* buddyTree;
-SDTABLE* sdTable;
+my_heap_t* defaultHeap;
 
 
-void my_setup(enum malloc_type type, int mem_size, void *start_of_memory)
+void my_setup(enum malloc_type type, size_t mem_size, void *start_of_memory)
 {
-    // initialize global variables
-    policy = type;
-    buddyTree = init_buddy_tree(mem_size, start_of_memory);
-    sdTable = init_sd_table();
+    // a new setup replaces the previous default heap
+    if (defaultHeap != NULL){
+        my_heap_destroy(defaultHeap);
+    }
+    defaultHeap = my_heap_create(type, mem_size, start_of_memory);
 }
 
 
-void *my_malloc(int size)
+void *my_setup_hugepage(enum malloc_type type, size_t mem_size, enum hugepage_mode mode)
 {
-    switch (policy)
-    {
-    case MALLOC_SLAB: ;
-        // initialize local variables
-        void* memAddr;
-        int objSize = (HEADER_SIZE + size);
+    my_heap_t* heap = my_heap_create_hugepage(type, mem_size, mode);
+    if (heap == NULL){
+        return NULL;
+    }
+
+    // a new setup replaces the previous default heap
+    if (defaultHeap != NULL){
+        my_heap_destroy(defaultHeap);
+    }
+    defaultHeap = heap;
+    return heap->buddyTree->root->startAddr;
+}
+
+
+void *my_setup_file(enum malloc_type type, size_t mem_size, int fd)
+{
+    my_heap_t* heap = my_heap_open_file(type, mem_size, fd);
+    if (heap == NULL){
+        return NULL;
+    }
+
+    // a new setup replaces the previous default heap
+    if (defaultHeap != NULL){
+        my_heap_destroy(defaultHeap);
+    }
+    defaultHeap = heap;
+    return heap->mappedRegion;
+}
+
+
+void *my_setup_shared(enum malloc_type type, size_t mem_size, int fd)
+{
+    my_heap_t* heap = my_heap_open_shared(type, mem_size, fd);
+    if (heap == NULL){
+        return NULL;
+    }
+
+    // a new setup replaces the previous default heap
+    if (defaultHeap != NULL){
+        my_heap_destroy(defaultHeap);
+    }
+    defaultHeap = heap;
+    return heap->mappedRegion;
+}
+
+
+void my_setup_numa(enum malloc_type type, size_t mem_size, void *start_of_memory)
+{
+    // a new setup replaces the previous default heap
+    if (defaultHeap != NULL){
+        my_heap_destroy(defaultHeap);
+    }
+    defaultHeap = my_heap_create_numa(type, mem_size, start_of_memory);
+}
+
+
+void *my_malloc_node(size_t size, int node)
+{
+    return my_heap_malloc_node(defaultHeap, size, node);
+}
+
+
+void my_set_lazy_coalescing(bool enabled, int watermark)
+{
+    my_heap_set_lazy_coalescing(defaultHeap, enabled, watermark);
+}
+
+
+void my_set_headerless(bool enabled)
+{
+    my_heap_set_headerless(defaultHeap, enabled);
+}
+
+
+void my_set_segregated_placement(bool enabled)
+{
+    my_heap_set_segregated_placement(defaultHeap, enabled);
+}
+
+
+void *my_malloc_hint(size_t size, enum lifetime_hint lifetime)
+{
+    return my_heap_malloc_hint(defaultHeap, size, lifetime);
+}
+
+
+double my_fragmentation_index(void)
+{
+    return my_heap_fragmentation_index(defaultHeap);
+}
+
+
+size_t my_largest_free_block(void)
+{
+    return my_heap_largest_free_block(defaultHeap);
+}
+
+
+my_handle_t my_malloc_movable(size_t size)
+{
+    return my_heap_malloc_movable(defaultHeap, size);
+}
+
+
+void *my_pin(my_handle_t handle)
+{
+    return my_heap_pin(defaultHeap, handle);
+}
+
+
+void my_unpin(my_handle_t handle)
+{
+    my_heap_unpin(defaultHeap, handle);
+}
+
+
+void my_free_movable(my_handle_t handle)
+{
+    my_heap_free_movable(defaultHeap, handle);
+}
+
+
+long my_compact(long budget)
+{
+    return my_heap_compact(defaultHeap, budget);
+}
+
+
+void my_set_decay(int idle_ops, bool lazy_free)
+{
+    my_heap_set_decay(defaultHeap, idle_ops, lazy_free);
+}
+
+
+long my_release_idle_memory(void)
+{
+    return my_heap_release_idle_memory(defaultHeap);
+}
+
+
+void my_set_thread_safe(bool enabled)
+{
+    my_heap_set_thread_safe(defaultHeap, enabled);
+}
+
+
+void my_set_heap_profiling(long sample_interval)
+{
+    my_heap_set_heap_profiling(defaultHeap, sample_interval);
+}
+
+
+bool my_dump_heap_profile(const char *path)
+{
+    return my_heap_dump_heap_profile(defaultHeap, path);
+}
+
+
+void my_set_magazines(bool enabled)
+{
+    my_heap_set_magazines(defaultHeap, enabled);
+}
+
+
+void my_set_root(void *ptr)
+{
+    my_heap_set_root(defaultHeap, ptr);
+}
+
+
+void *my_get_root(void)
+{
+    return my_heap_get_root(defaultHeap);
+}
+
+
+bool my_sync(void)
+{
+    return my_heap_sync(defaultHeap);
+}
+
+
+size_t my_offset_of(void *ptr)
+{
+    return my_heap_offset_of(defaultHeap, ptr);
+}
+
+
+void *my_ptr_at(size_t offset)
+{
+    return my_heap_ptr_at(defaultHeap, offset);
+}
+
+
+my_cache_t *my_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+    return my_heap_cache_create(defaultHeap, name, size, align, ctor, dtor);
+}
+
 
-        // check to see if we have a slab descriptor entry in table for this size
-        SDENTRY* sdEntry = sd_table_search(sdTable, objSize);
+void my_arena_reset(void)
+{
+    my_heap_arena_reset(defaultHeap);
+}
+
+
+my_arena_mark_t my_arena_mark(void)
+{
+    return my_heap_arena_mark(defaultHeap);
+}
+
+
+void my_arena_rewind(my_arena_mark_t mark)
+{
+    my_heap_arena_rewind(defaultHeap, mark);
+}
+
+
+void *my_malloc(size_t size)
+{
+    return my_heap_malloc(defaultHeap, size);
+}
+
+
+void my_free(void *ptr)
+{
+    my_heap_free(defaultHeap, ptr);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_heap_lock
+// Description  : sets up a heap's lock, recursive so that heap calls made from inside
+//                other heap calls (compaction, movable memory) do not deadlock
+//
+// Inputs       : heap - heap to set up
+// Outputs      : none
+
+static void init_heap_lock(my_heap_t *heap)
+{
+    pthread_mutexattr_t lockAttr;
+    pthread_mutexattr_init(&lockAttr);
+    pthread_mutexattr_settype(&lockAttr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&heap->lock, &lockAttr);
+    pthread_mutexattr_destroy(&lockAttr);
+    heap->threadSafe = false;
+    heap->shared = false;
+    heap->lockDepth = 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lock_heap, unlock_heap
+// Description  : take and drop a heap's lock, if the heap is thread safe. a shared heap
+//                also takes its region's lock, in the outermost call only, since the
+//                mutex already lets the calls of one thread nest
+//
+// Inputs       : heap - heap to lock or unlock
+// Outputs      : none
+
+static void lock_heap(my_heap_t *heap)
+{
+    if (heap->threadSafe){
+        pthread_mutex_lock(&heap->lock);
+    }
+    if (heap->shared && (heap->lockDepth++ == 0)){
+        lock_persistent_region(heap->persistent);
+    }
+}
+
+static void unlock_heap(my_heap_t *heap)
+{
+    if (heap->shared && (--heap->lockDepth == 0)){
+        unlock_persistent_region(heap->persistent);
+    }
+    if (heap->threadSafe){
+        pthread_mutex_unlock(&heap->lock);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : uses_magazines
+// Description  : tells whether the heap's slab objects go through the calling thread's
+//                magazines, which need no lock. sampled heaps keep every call behind
+//                the lock, and their objects in the slabs
+//
+// Inputs       : heap - heap being called
+// Outputs      : true if allocations and frees go through the thread's magazines
+
+static bool uses_magazines(my_heap_t *heap)
+{
+    return (heap->policy == MALLOC_SLAB) && (heap->sdTable != NULL) && heap->sdTable->magazines && (heap->profiler == NULL);
+}
+
+
+my_heap_t *my_heap_create(enum malloc_type type, size_t mem_size, void *start_of_memory)
+{
+    my_heap_t* heap = malloc(sizeof(my_heap_t));
+    heap->policy = type;
+    heap->buddyTree = init_buddy_tree(mem_size, start_of_memory);
+    heap->sdTable = init_sd_table();
+    heap->arena = NULL;
+    heap->headerless = false;
+    heap->mappedRegion = NULL;
+    heap->mappedSize = 0;
+    heap->nodeHeaps = NULL;
+    heap->nodeCount = 0;
+    heap->movables = NULL;
+    heap->movableCapacity = 0;
+    heap->freeMovable = -1;
+    heap->profiler = NULL;
+    heap->persistent = NULL;
+    init_heap_lock(heap);
+    if (type == MALLOC_ARENA){
+        heap->arena = init_arena();
+    }
+    return heap;
+}
+
+
+my_heap_t *my_heap_create_hugepage(enum malloc_type type, size_t mem_size, enum hugepage_mode mode)
+{
+    void* mappedRegion;
+    size_t mappedSize;
+    void* start_of_memory = map_region(mem_size, mode, &mappedRegion, &mappedSize);
+    if (start_of_memory == NULL){
+        return NULL;
+    }
+
+    // the heap owns this mapping and unmaps it when destroyed
+    my_heap_t* heap = my_heap_create(type, mem_size, start_of_memory);
+    heap->mappedRegion = mappedRegion;
+    heap->mappedSize = mappedSize;
+    init_touched_pages(heap->buddyTree);
+    return heap;
+}
+
+
+my_heap_t *my_heap_create_numa(enum malloc_type type, size_t mem_size, void *start_of_memory)
+{
+    int nodeCount = numa_node_count();
+
+    // nothing to split on a single node machine, or in a region too small to give every
+    // node at least one chunk
+    if ((nodeCount <= 1) || (mem_size / nodeCount < MIN_MEM_CHUNK_SIZE)){
+        return my_heap_create(type, mem_size, start_of_memory);
+    }
+
+    // the parent heap keeps no memory of its own, it only hands requests to its node heaps
+    my_heap_t* heap = malloc(sizeof(my_heap_t));
+    heap->policy = type;
+    heap->buddyTree = NULL;
+    heap->sdTable = NULL;
+    heap->arena = NULL;
+    heap->headerless = false;
+    heap->mappedRegion = NULL;
+    heap->mappedSize = 0;
+    heap->nodeHeaps = malloc(nodeCount * sizeof(my_heap_t*));
+    heap->nodeCount = nodeCount;
+    heap->movables = NULL;
+    heap->movableCapacity = 0;
+    heap->freeMovable = -1;
+    heap->profiler = NULL;
+    heap->persistent = NULL;
+    init_heap_lock(heap);
+
+    // every node gets the same power of two part of the region, bound to that node
+    size_t partSize = (size_t)1 << (63 - __builtin_clzl(mem_size / nodeCount));
+    for (int node = 0; node < nodeCount; node++){
+        void* partStart = start_of_memory + node * partSize;
+        bind_to_numa_node(partStart, partSize, node);
+        heap->nodeHeaps[node] = my_heap_create(type, partSize, partStart);
+    }
+    return heap;
+}
 
-        // if an entry was found, try to add the new object to the the slab
-        if (sdEntry != NULL){
-            memAddr = add_new_memory_to_slab(sdEntry);
 
-            // if the slab is not full, return the found address
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_region_heap
+// Description  : maps a persistent or shared heap's region from a file and opens the heap
+//                in it, formatting the region if it holds no heap yet and may be formatted
+//
+// Inputs       : type - enum malloc_type of the heap
+//              : mem_size - number of bytes in the region, a power of two
+//              : fd - file descriptor of the file, memfd or shared memory object
+//              : shared - boolean for whether other processes use the region at the same time
+// Outputs      : the heap
+//              : NULL if the file could not be used
+
+static my_heap_t* open_region_heap(enum malloc_type type, size_t mem_size, int fd, bool shared)
+{
+    // only the buddy and slab policies keep all of their state in the region
+    if (((type != MALLOC_BUDDY) && (type != MALLOC_SLAB)) || (mem_size <= MIN_MEM_CHUNK_SIZE) || ((mem_size & (mem_size - 1)) != 0)){
+        return NULL;
+    }
+
+    // an empty file is grown and formatted, anything else has to be a heap of this size
+    // already. a shared region is also formatted while it is still zero filled, as a new
+    // memfd or shared memory object sized by its creator is
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0){
+        return NULL;
+    }
+    bool fresh = (fileStat.st_size == 0);
+    if (fresh ? (ftruncate(fd, mem_size) != 0) : ((size_t)fileStat.st_size != mem_size)){
+        return NULL;
+    }
+
+    void* region = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    PREGION* persistent = NULL;
+    if (region != MAP_FAILED){
+        persistent = attach_persistent_region(region, mem_size, type, MIN_MEM_CHUNK_SIZE, N_OBJS_PER_SLAB, fresh || shared);
+    }
+    if (persistent == NULL){
+        if (region != MAP_FAILED){
+            munmap(region, mem_size);
+        }
+        // leave a file that could not be formatted as empty as it was, unless other
+        // processes may have it mapped
+        if (fresh && !shared){
+            ftruncate(fd, 0);
+        }
+        return NULL;
+    }
+
+    // the heap has no bookkeeping outside the region, and unmaps it when destroyed
+    my_heap_t* heap = malloc(sizeof(my_heap_t));
+    heap->policy = type;
+    heap->buddyTree = NULL;
+    heap->sdTable = NULL;
+    heap->arena = NULL;
+    heap->headerless = false;
+    heap->mappedRegion = region;
+    heap->mappedSize = mem_size;
+    heap->nodeHeaps = NULL;
+    heap->nodeCount = 0;
+    heap->movables = NULL;
+    heap->movableCapacity = 0;
+    heap->freeMovable = -1;
+    heap->profiler = NULL;
+    heap->persistent = persistent;
+    init_heap_lock(heap);
+    heap->threadSafe = shared;
+    heap->shared = shared;
+    return heap;
+}
+
+
+my_heap_t *my_heap_open_file(enum malloc_type type, size_t mem_size, int fd)
+{
+    return open_region_heap(type, mem_size, fd, false);
+}
+
+
+my_heap_t *my_heap_open_shared(enum malloc_type type, size_t mem_size, int fd)
+{
+    return open_region_heap(type, mem_size, fd, true);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : node_heap_of
+// Description  : finds which of a NUMA-aware heap's node heaps manages the given address
+//
+//
+// Inputs       : heap - NUMA-aware heap
+//              : ptr - address inside the heap's memory
+// Outputs      : the node heap containing ptr
+//              : NULL if none of them do
+
+static my_heap_t* node_heap_of(my_heap_t *heap, void *ptr)
+{
+    for (int node = 0; node < heap->nodeCount; node++){
+        BUDDYTREE* nodeTree = heap->nodeHeaps[node]->buddyTree;
+        if ((ptr >= nodeTree->root->startAddr) && (ptr < nodeTree->root->startAddr + nodeTree->totalMemSize)){
+            return heap->nodeHeaps[node];
+        }
+    }
+    return NULL;
+}
+
+
+void *my_heap_malloc(my_heap_t *heap, size_t size)
+{
+    return my_heap_malloc_hint(heap, size, LIFETIME_DEFAULT);
+}
+
+
+void *my_heap_malloc_hint(my_heap_t *heap, size_t size, enum lifetime_hint lifetime)
+{
+    // NUMA-aware heaps serve the caller's node first and spill over to the others when it is full
+    if (heap->nodeHeaps != NULL){
+        int localNode = current_numa_node();
+        for (int i = 0; i < heap->nodeCount; i++){
+            void* memAddr = my_heap_malloc_hint(heap->nodeHeaps[(localNode + i) % heap->nodeCount], size, lifetime);
             if (memAddr != NULL){
-                put_size_in_header(memAddr, size);
                 return memAddr;
             }
         }
+        return NULL;
+    }
 
-        // slab size is made up of slab header and N objs including their headers all rounded up
-        int slabSize = next_power_of_two(HEADER_SIZE + (objSize) * N_OBJS_PER_SLAB);
+    // objects in the thread's magazines are handed out without the heap's lock
+    if (uses_magazines(heap)){
+        void* memAddr = magazine_alloc(heap->sdTable, size, HEADER_SIZE);
+        if (memAddr != NULL){
+            return memAddr;
+        }
+    }
 
-        // create a new node in the tree containing the memory for the new slab
-        TREENODE* newSlabNode = create_new_memory_node(buddyTree, slabSize);
+    void* memAddr = NULL;
+    lock_heap(heap);
+    switch (heap->policy)
+    {
+    case MALLOC_SLAB:
+        if (heap->persistent != NULL){
+            memAddr = persistent_slab_malloc(heap->persistent, size);
+            break;
+        }
+        memAddr = slab_malloc(heap->buddyTree, heap->sdTable, size, HEADER_SIZE, MIN_MEM_CHUNK_SIZE, N_OBJS_PER_SLAB);
+        break;
 
-        if (newSlabNode == NULL){
-            return NULL; // should return -1 here
+    case MALLOC_BUDDY:
+        if (heap->persistent != NULL){
+            memAddr = persistent_buddy_malloc(heap->persistent, size);
+            break;
         }
+        if (heap->headerless){
+            memAddr = buddy_malloc_headerless(heap->buddyTree, size, lifetime, MIN_MEM_CHUNK_SIZE);
+            break;
+        }
+        memAddr = buddy_malloc(heap->buddyTree, size, lifetime, HEADER_SIZE, MIN_MEM_CHUNK_SIZE);
+        break;
 
-        // check whether a new slab entry for the slab descriptor table must be created or not
-        if (sdEntry == NULL){
-            // since there is no entry in the table for slabs of type objSize, create one and add it to the table
-            sdEntry = init_sd_entry(newSlabNode->startAddr, objSize);
-            sd_table_insert(sdTable, sdEntry);
-        } else {
-            // since there is already an entry in the table for slabs of type objSize, jsut add the new slab to the entry
-            add_slab_to_entry(sdEntry, newSlabNode->startAddr);
+    case MALLOC_ARENA:
+        memAddr = arena_malloc(heap->arena, heap->buddyTree, size);
+        break;
+
+    default:
+        break;
+    }
+
+    // unsampled allocations only count down to the next sample
+    if ((heap->profiler != NULL) && (memAddr != NULL)){
+        heap->profiler->bytesUntilSample -= size;
+        if (heap->profiler->bytesUntilSample <= 0){
+            record_sample(heap->profiler, memAddr, size);
         }
+    }
+    unlock_heap(heap);
+    return memAddr;
+}
 
-        // allocate a spot of memory in the slab
-        memAddr = add_new_memory_to_slab(sdEntry);
 
-        put_size_in_header(memAddr, size);
-        return memAddr;
+void *my_heap_malloc_node(my_heap_t *heap, size_t size, int node)
+{
+    // a heap that is not NUMA-aware is all on one node
+    if (heap->nodeHeaps == NULL){
+        return my_heap_malloc(heap, size);
+    }
+    if ((node < 0) || (node >= heap->nodeCount)){
+        return NULL;
+    }
+    return my_heap_malloc(heap->nodeHeaps[node], size);
+}
+
+
+void my_heap_free(my_heap_t *heap, void *ptr)
+{
+    // like free(), freeing NULL does nothing
+    if (ptr == NULL){
+        return;
+    }
+
+    // hand the free to whichever node heap the memory came from
+    if (heap->nodeHeaps != NULL){
+        my_heap_t* nodeHeap = node_heap_of(heap, ptr);
+        FREE_CHECK(nodeHeap != NULL, "invalid pointer", ptr);
+        my_heap_free(nodeHeap, ptr);
+        return;
+    }
 
-    case MALLOC_BUDDY: ;
-        // find out how big of a chunk user will need
-        int chunkSize = next_power_of_two(size + HEADER_SIZE);
+    // objects go back to the thread's magazines without the heap's lock
+    if (uses_magazines(heap)){
+        slab_magazine_free(heap->sdTable, ptr, HEADER_SIZE, MIN_MEM_CHUNK_SIZE, N_OBJS_PER_SLAB);
+        return;
+    }
 
-        // add a new node to the tree containing chunksize memory
-        TREENODE* newNode = create_new_memory_node(buddyTree, chunkSize);
+    lock_heap(heap);
+    if ((heap->profiler != NULL) && (heap->profiler->liveSamples > 0)){
+        forget_sample(heap->profiler, ptr);
+    }
 
-        if (newNode == NULL){
-            return NULL; // should return -1 here
+    switch (heap->policy)
+    {
+    case MALLOC_SLAB:
+        if (heap->persistent != NULL){
+            persistent_slab_free(heap->persistent, ptr);
+            break;
         }
+        slab_free(heap->buddyTree, heap->sdTable, ptr, HEADER_SIZE, N_OBJS_PER_SLAB);
+        break;
 
-        // place the size of the user's memory in the header bytes
-        put_size_in_header(newNode->startAddr + HEADER_SIZE, size);
+    case MALLOC_BUDDY:
+        if (heap->persistent != NULL){
+            persistent_buddy_free(heap->persistent, ptr);
+            break;
+        }
+        if (heap->headerless){
+            buddy_free_headerless(heap->buddyTree, ptr);
+            break;
+        }
+        buddy_free(heap->buddyTree, ptr, HEADER_SIZE);
+        break;
 
-        // return the start of the user's usable memory
-        return newNode->startAddr + HEADER_SIZE;
+    case MALLOC_ARENA:
+        // arena objects are only released by my_arena_reset() or my_arena_rewind()
+        break;
 
     default:
         break;
     }
+    unlock_heap(heap);
 }
 
 
-void my_free(void *ptr)
+my_handle_t my_heap_malloc_movable(my_heap_t *heap, size_t size)
 {
-    switch (policy)
-    {
-    case MALLOC_SLAB: ;
-        // Retrieve information about what we're trying to free
-        int type = get_size_in_header(ptr);
-        int objectSize = (HEADER_SIZE + type);
-        SDENTRY* entry = sd_table_search(sdTable, objectSize);
-        SLABPTR* slab = NULL;
-        int slabSize = HEADER_SIZE + (objectSize) * N_OBJS_PER_SLAB;
-        if(entry == NULL) {
-            return;
-        }
-        // Traverse the slabs looking for which contains the chunk we want to free
-        SLABPTR* travPointer = entry->slabPtr;
-        while(travPointer != NULL) {
-        void* slabStartAddress = travPointer->slabStartAddr;
-            if( (ptr > slabStartAddress) && (ptr < slabStartAddress + slabSize) ) {
-                slab = entry->slabPtr;
-                break;
-            }
-            travPointer = travPointer->next;
+    lock_heap(heap);
+    void* memAddr = my_heap_malloc(heap, size);
+    if (memAddr == NULL){
+        unlock_heap(heap);
+        return 0;
+    }
+
+    // grow the handle table when every entry is in use, chaining the new entries as unused
+    if (heap->freeMovable == -1){
+        int oldCapacity = heap->movableCapacity;
+        int newCapacity = (oldCapacity == 0) ? 64 : oldCapacity * 2;
+        heap->movables = realloc(heap->movables, newCapacity * sizeof(MOVABLE));
+        for (int i = oldCapacity; i < newCapacity; i++){
+            heap->movables[i].ptr = NULL;
+            heap->movables[i].nextFree = (i + 1 < newCapacity) ? i + 1 : -1;
         }
-        // If there none of our slabs contain what were trying to free
-        if(slab == NULL) {
-            return;
+        heap->movableCapacity = newCapacity;
+        heap->freeMovable = oldCapacity;
+    }
+
+    int index = heap->freeMovable;
+    MOVABLE* movable = &heap->movables[index];
+    heap->freeMovable = movable->nextFree;
+    movable->ptr = memAddr;
+    movable->size = size;
+    movable->pinCount = 0;
+    movable->nextFree = -1;
+    unlock_heap(heap);
+
+    // handles start at 1 so that 0 can mean failure
+    return index + 1;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : movable_of
+// Description  : finds the handle table entry of a handle
+//
+//
+// Inputs       : heap - heap the handle came from
+//              : handle - handle returned by my_heap_malloc_movable
+// Outputs      : the entry of the handle
+//              : NULL if the handle is not in use
+
+static MOVABLE* movable_of(my_heap_t *heap, my_handle_t handle)
+{
+    if ((handle <= 0) || (handle > heap->movableCapacity) || (heap->movables[handle - 1].ptr == NULL)){
+        return NULL;
+    }
+    return &heap->movables[handle - 1];
+}
+
+
+void *my_heap_pin(my_heap_t *heap, my_handle_t handle)
+{
+    lock_heap(heap);
+    MOVABLE* movable = movable_of(heap, handle);
+    void* memAddr = NULL;
+    if (movable != NULL){
+        movable->pinCount++;
+        memAddr = movable->ptr;
+    }
+    unlock_heap(heap);
+    return memAddr;
+}
+
+
+void my_heap_unpin(my_heap_t *heap, my_handle_t handle)
+{
+    lock_heap(heap);
+    MOVABLE* movable = movable_of(heap, handle);
+    if ((movable != NULL) && (movable->pinCount > 0)){
+        movable->pinCount--;
+    }
+    unlock_heap(heap);
+}
+
+
+void my_heap_free_movable(my_heap_t *heap, my_handle_t handle)
+{
+    lock_heap(heap);
+    MOVABLE* movable = movable_of(heap, handle);
+    if (movable == NULL){
+        unlock_heap(heap);
+        return;
+    }
+    my_heap_free(heap, movable->ptr);
+
+    // put the entry back on the unused chain
+    movable->ptr = NULL;
+    movable->nextFree = heap->freeMovable;
+    heap->freeMovable = handle - 1;
+    unlock_heap(heap);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_movables_by_address
+// Description  : qsort comparison that orders movable entries from the highest address down
+//
+//
+// Inputs       : a, b - pointers to MOVABLE* entries
+// Outputs      : negative if a is at a higher address than b, positive if lower
+
+static int compare_movables_by_address(const void *a, const void *b)
+{
+    void* ptrA = (*(MOVABLE**)a)->ptr;
+    void* ptrB = (*(MOVABLE**)b)->ptr;
+    return (ptrA < ptrB) - (ptrA > ptrB);
+}
+
+
+long my_heap_compact(my_heap_t *heap, long budget)
+{
+    // arena memory is only ever released in bulk, there is nothing to gain by moving it
+    if (heap->policy == MALLOC_ARENA){
+        return 0;
+    }
+
+    // the handle table may be created by another thread until the lock is held
+    lock_heap(heap);
+    if (heap->movables == NULL){
+        unlock_heap(heap);
+        return 0;
+    }
+
+    // gather every movable that is not pinned, starting from the highest address
+    MOVABLE** candidates = malloc(heap->movableCapacity * sizeof(MOVABLE*));
+    int nCandidates = 0;
+    for (int i = 0; i < heap->movableCapacity; i++){
+        if ((heap->movables[i].ptr != NULL) && (heap->movables[i].pinCount == 0)){
+            candidates[nCandidates++] = &heap->movables[i];
         }
+    }
+    qsort(candidates, nCandidates, sizeof(MOVABLE*), compare_movables_by_address);
 
-        int slabBitMapIndex = -1;
-        // Iterate through slab until we find the index of the address we are trying to free
-        for(int i = 0; i < N_OBJS_PER_SLAB; i++) {
-            void* chunkAddr = ( slab->slabStartAddr + 2 * HEADER_SIZE + (i*objectSize) );
-            if(chunkAddr == ptr) {
-                slabBitMapIndex = i;
-                break;
-            }
+    // allocate a second copy while the first is still in place, so the new copy lands
+    // in the best hole elsewhere. keep it only if that is lower than where it was, which
+    // empties the high blocks so that they can merge
+    long moved = 0;
+    for (int i = 0; (i < nCandidates) && (moved < budget); i++){
+        MOVABLE* movable = candidates[i];
+        void* newAddr = my_heap_malloc(heap, movable->size);
+        if (newAddr == NULL){
+            continue;
         }
-        // This shouldnt happen, but just in case
-        if(slabBitMapIndex == -1) {
-            return;
+        if (newAddr > movable->ptr){
+            my_heap_free(heap, newAddr);
+            continue;
         }
 
-        // Flip the bit to a 0 to represent it as a hole
-        slab->slabBitMap[slabBitMapIndex] = 0;
+        memcpy(newAddr, movable->ptr, movable->size);
+        my_heap_free(heap, movable->ptr);
+        movable->ptr = newAddr;
+        moved += movable->size;
+    }
 
-        // Iterate through slabs bit map to check to see if slab is now empty
-        bool emptySlab = true;
-        for(int i = 0; i < N_OBJS_PER_SLAB; i++) {
-            if(slab->slabBitMap[i] == 1) {
-                emptySlab = false;
-                break;
-            }
+    free(candidates);
+    unlock_heap(heap);
+    return moved;
+}
+
+
+void my_heap_destroy(my_heap_t *heap)
+{
+    free(heap->movables);
+
+    if (heap->nodeHeaps != NULL){
+        for (int node = 0; node < heap->nodeCount; node++){
+            my_heap_destroy(heap->nodeHeaps[node]);
         }
+        free(heap->nodeHeaps);
+        pthread_mutex_destroy(&heap->lock);
+        free(heap);
+        return;
+    }
+
+    // only the bookkeeping is freed, unless the heap mapped its memory itself
+    pthread_mutex_destroy(&heap->lock);
+    if (heap->profiler != NULL){
+        destroy_profiler(heap->profiler);
+    }
+    if (heap->arena != NULL){
+        destroy_arena(heap->arena);
+    }
+    if (heap->persistent == NULL){
+        destroy_sd_table(heap->sdTable);
+        destroy_buddy_tree(heap->buddyTree);
+    }
+    if (heap->mappedRegion != NULL){
+        munmap(heap->mappedRegion, heap->mappedSize);
+    }
+    free(heap);
+}
+
 
-        // If slab is now empty, remove it from slab linked list and update hole tree
-        if(emptySlab) {
-            TREENODE* removalNode = find_node_by_address(buddyTree->root, slab->slabStartAddr);
-            remove_slab_from_entry(entry, slab);
-            removalNode->isMem = false;
-            removalNode->isHole = true;
-            check_for_merge(removalNode->parent, buddyTree->totalMemSize);
+void my_heap_set_lazy_coalescing(my_heap_t *heap, bool enabled, int watermark)
+{
+    if (heap->nodeHeaps != NULL){
+        for (int node = 0; node < heap->nodeCount; node++){
+            my_heap_set_lazy_coalescing(heap->nodeHeaps[node], enabled, watermark);
         }
+        return;
+    }
+
+    // a persistent heap has no tree or slab table of its own to set up
+    if (heap->persistent != NULL){
+        return;
+    }
+
+    BUDDYTREE* buddyTree = heap->buddyTree;
+    buddyTree->lazyCoalesce = enabled;
+    buddyTree->mergeWatermark = watermark;
+
+    // going back to eager mode, merge whatever was left unmerged
+    if (!enabled && buddyTree->deferredMerges > 0){
+        coalesce_tree(buddyTree);
+    }
+}
 
-        // If there are no longer any slabs corresponing to the type of the memory we freed, delete entry in table
-        if(entry->slabPtr == NULL) {
-            sd_table_delete(sdTable, entry);
+
+void my_heap_set_headerless(my_heap_t *heap, bool enabled)
+{
+    if (heap->nodeHeaps != NULL){
+        for (int node = 0; node < heap->nodeCount; node++){
+            my_heap_set_headerless(heap->nodeHeaps[node], enabled);
         }
-        break;
-    
-    case MALLOC_BUDDY: ;
-        // find the node in the tree trying to be removed
-        TREENODE* removalNode = find_node_by_address(buddyTree->root, ptr - HEADER_SIZE);
+        return;
+    }
 
-        // set the node as a hole
-        removalNode->isMem = false;
-        removalNode->isHole = true;
+    if (heap->persistent != NULL){
+        return;
+    }
 
-        // merge any holes next to each other in the tree
-        check_for_merge(removalNode->parent, buddyTree->totalMemSize);
+    heap->headerless = enabled;
+    if (enabled){
+        init_order_side_table(heap->buddyTree, MIN_MEM_CHUNK_SIZE);
+    }
+}
 
-        break;
 
-    default:
-        break;
+void my_heap_set_decay(my_heap_t *heap, int idle_ops, bool lazy_free)
+{
+    if (heap->nodeHeaps != NULL){
+        for (int node = 0; node < heap->nodeCount; node++){
+            my_heap_set_decay(heap->nodeHeaps[node], idle_ops, lazy_free);
+        }
+        return;
+    }
+
+    if (heap->persistent != NULL){
+        return;
+    }
+
+    heap->buddyTree->decayIdleOps = idle_ops;
+    heap->buddyTree->decayLazyFree = lazy_free;
+}
+
+
+long my_heap_release_idle_memory(my_heap_t *heap)
+{
+    if (heap->nodeHeaps != NULL){
+        long released = 0;
+        for (int node = 0; node < heap->nodeCount; node++){
+            released += my_heap_release_idle_memory(heap->nodeHeaps[node]);
+        }
+        return released;
+    }
+
+    if (heap->persistent != NULL){
+        return 0;
+    }
+
+    // with decay off the idle threshold is 0, so a manual pass releases every free hole
+    lock_heap(heap);
+    long released = release_idle_holes(heap->buddyTree, heap->buddyTree->root);
+    unlock_heap(heap);
+    return released;
+}
+
+
+void my_heap_set_thread_safe(my_heap_t *heap, bool enabled)
+{
+    // a shared heap always locks, other processes use it whatever this one does. the
+    // parent of NUMA node heaps locks too, for its handle table
+    heap->threadSafe = enabled || heap->shared;
+    if (heap->sdTable != NULL){
+        heap->sdTable->depotLock = heap->threadSafe ? &heap->lock : NULL;
+    }
+
+    if (heap->nodeHeaps != NULL){
+        for (int node = 0; node < heap->nodeCount; node++){
+            my_heap_set_thread_safe(heap->nodeHeaps[node], enabled);
+        }
+    }
+}
+
+
+void my_heap_set_magazines(my_heap_t *heap, bool enabled)
+{
+    if (heap->nodeHeaps != NULL){
+        for (int node = 0; node < heap->nodeCount; node++){
+            my_heap_set_magazines(heap->nodeHeaps[node], enabled);
+        }
+        return;
+    }
+
+    if (heap->persistent != NULL){
+        return;
+    }
+
+    lock_heap(heap);
+    if (!enabled && heap->sdTable->magazines){
+        slab_flush_magazines(heap->buddyTree, heap->sdTable, HEADER_SIZE, N_OBJS_PER_SLAB, true);
+    }
+
+    // frees into magazines find their slab through the index, since they do not take the lock
+    if (enabled && (heap->policy == MALLOC_SLAB) && !index_slabs(heap->sdTable, heap->buddyTree, MIN_MEM_CHUNK_SIZE)){
+        enabled = false;
+    }
+    heap->sdTable->depotLock = heap->threadSafe ? &heap->lock : NULL;
+    heap->sdTable->magazines = enabled && (heap->policy == MALLOC_SLAB);
+    unlock_heap(heap);
+}
+
+
+my_cache_t *my_heap_cache_create(my_heap_t *heap, const char *name, size_t size, size_t align, void (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+    if (align == 0){
+        align = ARENA_ALIGNMENT;
+    }
+    if ((size == 0) || ((align & (align - 1)) != 0)){
+        return NULL;
+    }
+
+    // a cache on a NUMA-aware heap takes its slabs from the caller's node
+    if (heap->nodeHeaps != NULL){
+        heap = heap->nodeHeaps[current_numa_node() % heap->nodeCount];
+    }
+    if (heap->persistent != NULL){
+        return NULL;
+    }
+
+    // a slab of objects, and the room to align the first one, must fit in the heap. the
+    // heap is at most half the address space, so none of the sums below overflow
+    size_t heapSize = heap->buddyTree->totalMemSize;
+    if ((size > heapSize) || (align > heapSize)){
+        return NULL;
+    }
+    size_t objSize = (size + align - 1) & ~(align - 1);
+    if (objSize > (heapSize - (align - 1)) / CACHE_OBJS_PER_SLAB){
+        return NULL;
+    }
+
+    my_cache_t* cache = malloc(sizeof(my_cache_t));
+    snprintf(cache->name, CACHE_NAME_LEN, "%s", (name != NULL) ? name : "");
+    cache->objSize = objSize;
+    cache->align = align;
+    cache->slabSize = next_power_of_two(objSize * CACHE_OBJS_PER_SLAB + align - 1, MIN_MEM_CHUNK_SIZE);
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->heap = heap;
+    cache->slabs = NULL;
+    return cache;
+}
+
+
+void *my_cache_alloc(my_cache_t *cache)
+{
+    lock_heap(cache->heap);
+    void* obj = cache_alloc_object(cache, cache->heap->buddyTree);
+    unlock_heap(cache->heap);
+    return obj;
+}
+
+
+void my_cache_free(my_cache_t *cache, void *obj)
+{
+    if (obj == NULL){
+        return;
+    }
+    lock_heap(cache->heap);
+    cache_free_object(cache, cache->heap->buddyTree, obj);
+    unlock_heap(cache->heap);
+}
+
+
+void my_cache_destroy(my_cache_t *cache)
+{
+    lock_heap(cache->heap);
+    while (cache->slabs != NULL){
+        CACHESLAB* slab = cache->slabs;
+        cache->slabs = slab->next;
+        cache_release_slab(cache, cache->heap->buddyTree, slab);
+    }
+    unlock_heap(cache->heap);
+    free(cache);
+}
+
+
+void my_heap_set_heap_profiling(my_heap_t *heap, long sample_interval)
+{
+    if (heap->nodeHeaps != NULL){
+        for (int node = 0; node < heap->nodeCount; node++){
+            my_heap_set_heap_profiling(heap->nodeHeaps[node], sample_interval);
+        }
+        return;
+    }
+
+    // a new interval starts a new profile
+    lock_heap(heap);
+    if (heap->profiler != NULL){
+        destroy_profiler(heap->profiler);
+        heap->profiler = NULL;
+    }
+    if (sample_interval > 0){
+        heap->profiler = init_profiler(sample_interval);
+    }
+    unlock_heap(heap);
+}
+
+
+bool my_heap_dump_heap_profile(my_heap_t *heap, const char *path)
+{
+    // a NUMA-aware heap writes the samples of all of its node heaps as one profile
+    int profilerCount = (heap->nodeHeaps != NULL) ? heap->nodeCount : 1;
+    my_heap_t** heaps = (heap->nodeHeaps != NULL) ? heap->nodeHeaps : &heap;
+    PROFILER* profilers[MAX_NUMA_NODES];
+    for (int i = 0; i < profilerCount; i++){
+        if (heaps[i]->profiler == NULL){
+            return false;
+        }
+        profilers[i] = heaps[i]->profiler;
+    }
+
+    FILE* file = fopen(path, "w");
+    if (file == NULL){
+        return false;
+    }
+    for (int i = 0; i < profilerCount; i++){
+        lock_heap(heaps[i]);
+    }
+    write_heap_profile(file, profilers, profilerCount);
+    for (int i = 0; i < profilerCount; i++){
+        unlock_heap(heaps[i]);
+    }
+    return fclose(file) == 0;
+}
+
+
+void my_heap_set_segregated_placement(my_heap_t *heap, bool enabled)
+{
+    if (heap->nodeHeaps != NULL){
+        for (int node = 0; node < heap->nodeCount; node++){
+            my_heap_set_segregated_placement(heap->nodeHeaps[node], enabled);
+        }
+        return;
+    }
+
+    if (heap->persistent != NULL){
+        return;
+    }
+
+    if (enabled){
+        init_region_classes(heap->buddyTree);
+    } else {
+        free(heap->buddyTree->regionClasses);
+        heap->buddyTree->regionClasses = NULL;
+    }
+}
+
+
+double my_heap_fragmentation_index(my_heap_t *heap)
+{
+    size_t totalFree = 0;
+    size_t largestFree = 0;
+
+    if (heap->nodeHeaps != NULL){
+        for (int node = 0; node < heap->nodeCount; node++){
+            lock_heap(heap->nodeHeaps[node]);
+            measure_free_holes(heap->nodeHeaps[node]->buddyTree->root, &totalFree, &largestFree);
+            unlock_heap(heap->nodeHeaps[node]);
+        }
+    } else if (heap->persistent != NULL){
+        lock_heap(heap);
+        measure_persistent_holes(heap->persistent, &totalFree, &largestFree);
+        unlock_heap(heap);
+    } else {
+        lock_heap(heap);
+        measure_free_holes(heap->buddyTree->root, &totalFree, &largestFree);
+        unlock_heap(heap);
+    }
+
+    if (totalFree == 0){
+        return 0.0;
+    }
+    return 1.0 - (double)largestFree / (double)totalFree;
+}
+
+
+size_t my_heap_largest_free_block(my_heap_t *heap)
+{
+    size_t totalFree = 0;
+    size_t largestFree = 0;
+
+    if (heap->nodeHeaps != NULL){
+        for (int node = 0; node < heap->nodeCount; node++){
+            lock_heap(heap->nodeHeaps[node]);
+            measure_free_holes(heap->nodeHeaps[node]->buddyTree->root, &totalFree, &largestFree);
+            unlock_heap(heap->nodeHeaps[node]);
+        }
+    } else if (heap->persistent != NULL){
+        lock_heap(heap);
+        measure_persistent_holes(heap->persistent, &totalFree, &largestFree);
+        unlock_heap(heap);
+    } else {
+        lock_heap(heap);
+        measure_free_holes(heap->buddyTree->root, &totalFree, &largestFree);
+        unlock_heap(heap);
+    }
+    return largestFree;
+}
+
+
+void my_heap_arena_reset(my_heap_t *heap)
+{
+    if (heap->nodeHeaps != NULL){
+        for (int node = 0; node < heap->nodeCount; node++){
+            my_heap_arena_reset(heap->nodeHeaps[node]);
+        }
+        return;
+    }
+
+    if (heap->arena == NULL){
+        return;
+    }
+    lock_heap(heap);
+    arena_rewind(heap->arena, heap->buddyTree, heap->profiler, NULL, NULL);
+    unlock_heap(heap);
+}
+
+
+my_arena_mark_t my_heap_arena_mark(my_heap_t *heap)
+{
+    // marks of a NUMA-aware heap belong to the arena of the caller's node
+    if (heap->nodeHeaps != NULL){
+        return my_heap_arena_mark(heap->nodeHeaps[current_numa_node() % heap->nodeCount]);
+    }
+
+    my_arena_mark_t mark = {NULL, NULL};
+    lock_heap(heap);
+    if (heap->arena != NULL){
+        mark.chunk = heap->arena->current;
+        mark.position = heap->arena->bumpPtr;
+    }
+    unlock_heap(heap);
+    return mark;
+}
+
+
+void my_heap_arena_rewind(my_heap_t *heap, my_arena_mark_t mark)
+{
+    if (heap->nodeHeaps != NULL){
+        // a mark is routed by its position, which is in its chunk's memory (the chunk itself
+        // may be gone if the mark is stale), an empty mark rewinds the caller's node
+        my_heap_t* nodeHeap = NULL;
+        if (mark.chunk != NULL){
+            nodeHeap = node_heap_of(heap, mark.position);
+        } else {
+            nodeHeap = heap->nodeHeaps[current_numa_node() % heap->nodeCount];
+        }
+        if (nodeHeap != NULL){
+            my_heap_arena_rewind(nodeHeap, mark);
+        }
+        return;
+    }
+
+    if (heap->arena == NULL){
+        return;
+    }
+    lock_heap(heap);
+    arena_rewind(heap->arena, heap->buddyTree, heap->profiler, mark.chunk, mark.position);
+    unlock_heap(heap);
+}
+
+
+void my_heap_set_root(my_heap_t *heap, void *ptr)
+{
+    if (heap->persistent == NULL){
+        return;
+    }
+
+    // the root is kept as an offset, so that it still points at the object once the file
+    // is mapped somewhere else
+    __atomic_store_n(&heap->persistent->root, my_heap_offset_of(heap, ptr), __ATOMIC_RELEASE);
+}
+
+
+void *my_heap_get_root(my_heap_t *heap)
+{
+    if (heap->persistent == NULL){
+        return NULL;
+    }
+    return my_heap_ptr_at(heap, __atomic_load_n(&heap->persistent->root, __ATOMIC_ACQUIRE));
+}
+
+
+bool my_heap_sync(my_heap_t *heap)
+{
+    if (heap->persistent == NULL){
+        return false;
+    }
+    lock_heap(heap);
+    bool synced = (msync(heap->mappedRegion, heap->mappedSize, MS_SYNC) == 0);
+    unlock_heap(heap);
+    return synced;
+}
+
+
+size_t my_heap_offset_of(my_heap_t *heap, void *ptr)
+{
+    // the region's header is at offset 0, so 0 is free to stand for NULL
+    if ((heap->persistent == NULL) || (ptr <= heap->mappedRegion) || (ptr >= heap->mappedRegion + heap->mappedSize)){
+        return 0;
+    }
+    return ptr - heap->mappedRegion;
+}
+
+
+void *my_heap_ptr_at(my_heap_t *heap, size_t offset)
+{
+    if ((heap->persistent == NULL) || (offset == 0) || (offset >= heap->mappedSize)){
+        return NULL;
     }
+    return heap->mappedRegion + offset;
 }
@@ -22,11 +22,201 @@ enum malloc_type
 {
     MALLOC_BUDDY = 0, // Buddy allocator
     MALLOC_SLAB = 1,  // Slab allocator
+    MALLOC_ARENA = 2, // Arena (bump) allocator, memory is released in bulk
 };
 
+// Handle of an independent allocator instance
+typedef struct my_heap_struct my_heap_t;
+
+// Handle of movable memory, 0 is never a valid handle
+typedef int my_handle_t;
+
+// Handle of an object cache
+typedef struct my_cache_struct my_cache_t;
+
+// Expected lifetime of an allocation, used by segregated placement
+enum lifetime_hint
+{
+    LIFETIME_DEFAULT = 0, // Unknown
+    LIFETIME_SHORT = 1,   // Freed soon (request or frame scoped)
+    LIFETIME_LONG = 2,    // Kept for a long time (caches, tables)
+};
+
+// Huge page backing for regions the allocator maps itself
+enum hugepage_mode
+{
+    HUGEPAGE_NONE = 0,    // Regular pages
+    HUGEPAGE_MADVISE = 1, // Transparent huge pages via madvise(MADV_HUGEPAGE)
+    HUGEPAGE_HUGETLB = 2, // Explicit huge pages via MAP_HUGETLB, MADV_HUGEPAGE if none are reserved
+};
+
+// Position in an arena that can be rewound to
+typedef struct my_arena_mark_struct
+{
+    void *chunk;    // arena chunk that was being filled
+    void *position; // next free byte in that chunk
+} my_arena_mark_t;
+
 // APIs
-void my_setup(enum malloc_type type, int mem_size, void *start_of_memory);
-void *my_malloc(int size);
+void my_setup(enum malloc_type type, size_t mem_size, void *start_of_memory);
+// Maps a huge page aligned region itself and places small chunks in already touched
+// huge pages first. Returns the start of the region, NULL if it could not be mapped.
+void *my_setup_hugepage(enum malloc_type type, size_t mem_size, enum hugepage_mode mode);
+void *my_malloc(size_t size);
 void my_free(void *ptr);
 
+// NUMA-aware setup: the region is split across the machine's NUMA nodes, each part
+// bound to its node and managed by its own buddy tree and slab descriptor table.
+// my_malloc() serves the caller's node first, my_malloc_node() only the given node.
+// On a single node machine, or with a region too small to give every node a chunk, this
+// is the same as my_setup().
+void my_setup_numa(enum malloc_type type, size_t mem_size, void *start_of_memory);
+void *my_malloc_node(size_t size, int node);
+
+// Lazy buddy coalescing: freed chunks stay on their own size until an allocation
+// needs the memory or watermark (if > 0) frees have piled up. Call after my_setup().
+void my_set_lazy_coalescing(bool enabled, int watermark);
+
+// Header-less buddy chunks (MALLOC_BUDDY only): chunk orders are kept in a side table
+// instead of a HEADER_SIZE header, so a power of two request fits a chunk of its own
+// size. Call after my_setup() and before the first my_malloc().
+void my_set_headerless(bool enabled);
+
+// Arena APIs (MALLOC_ARENA only): my_free() is a no-op, memory is released by
+// resetting the whole arena or rewinding it to an earlier mark. A mark made stale by
+// an earlier reset or rewind is ignored (reported and aborted on in hardened builds).
+void my_arena_reset(void);
+my_arena_mark_t my_arena_mark(void);
+void my_arena_rewind(my_arena_mark_t mark);
+
+// Segregated placement: chunks smaller than a region (1 MiB, or 1/8 of the memory) only
+// share regions with chunks of the same size band and lifetime, so that long lived
+// small chunks do not pin down many large blocks. Call after my_setup().
+// my_fragmentation_index() is 1 - (largest hole / free memory): 0 when all free memory
+// is one hole, close to 1 when it is scattered.
+void my_set_segregated_placement(bool enabled);
+void *my_malloc_hint(size_t size, enum lifetime_hint lifetime);
+double my_fragmentation_index(void);
+size_t my_largest_free_block(void);
+
+// Movable memory: my_malloc_movable() returns a handle instead of a pointer. my_pin()
+// returns the memory's current address and keeps it in place until my_unpin().
+// my_compact() moves unpinned memory (at most budget bytes) into lower holes so the
+// blocks it leaves can merge, and returns the number of bytes moved.
+my_handle_t my_malloc_movable(size_t size);
+void *my_pin(my_handle_t handle);
+void my_unpin(my_handle_t handle);
+void my_free_movable(my_handle_t handle);
+long my_compact(long budget);
+
+// Decay: buddy holes of at least 64 KiB that stay free for idle_ops allocations and
+// frees are handed back to the OS with MADV_DONTNEED (MADV_FREE if lazy_free), and
+// fault back in when reused. A pass also runs every idle_ops operations; idle_ops 0
+// turns decay off. my_release_idle_memory() runs a pass now and returns the bytes released.
+void my_set_decay(int idle_ops, bool lazy_free);
+long my_release_idle_memory(void);
+
+// Thread safety: heaps are single threaded unless made thread safe, which puts every
+// allocation, free and maintenance call behind a per-heap lock. Memory may then be freed
+// from any thread. Settings should still be changed before the heap is shared.
+void my_set_thread_safe(bool enabled);
+
+// Heap profiling: with a sample interval above 0, about one allocation per sample_interval
+// bytes is sampled with its call stack (frame pointers) and tracked until it is freed.
+// 0 turns profiling off. my_dump_heap_profile() writes the samples as a pprof readable
+// heap_v2 profile, and returns false if the file could not be written or profiling is off.
+void my_set_heap_profiling(long sample_interval);
+bool my_dump_heap_profile(const char *path);
+
+// Magazines (MALLOC_SLAB only): each thread keeps the objects it frees in a pair of small
+// stacks per type, and hands them out again before the slabs are searched for a hole. A
+// thread uses its stacks without the heap's lock, and only takes it to trade a full or
+// empty stack with the heap's depot. A free is still checked against the object's slab
+// first, so bad and double frees are caught as they are without magazines. Heaps being
+// profiled skip the magazines. Off by default, since objects come back in a different
+// order. Turning magazines off gives every object they hold back to its slab, so no
+// other thread may be using the heap then.
+void my_set_magazines(bool enabled);
+
+// Persistent heaps (MALLOC_BUDDY or MALLOC_SLAB only): the region is mapped from the file fd
+// refers to, and all of the heap's bookkeeping is kept in it as offsets, so a later process
+// reopens the heap in O(1) wherever the file gets mapped. An empty file is grown to mem_size
+// (a power of two) and formatted, a file that holds a heap of the same type and size is
+// reopened as it is, and anything else is refused. Returns the start of the region, NULL
+// if the file could not be used. The root is where the program keeps its top object, to
+// find its data again after reopening. Changes reach the file as the kernel writes pages
+// back, my_sync() writes them out now. Movable handles and profiles are not kept in the
+// file. Lazy coalescing, header-less chunks, segregated placement, decay, magazines and
+// object caches are not available on a persistent heap.
+void *my_setup_file(enum malloc_type type, size_t mem_size, int fd);
+void my_set_root(void *ptr);
+void *my_get_root(void);
+bool my_sync(void);
+
+// Shared heaps: a persistent heap that any number of processes map from the same memfd,
+// shm_open or regular file and allocate from at the same time, memory allocated by one
+// process may be freed by another. Calls are serialized by a futex-based lock kept in the
+// region. The first process to open a zero filled region formats it, the others wait until
+// it is ready. A region that is neither zero filled nor a heap is refused, and so is one a
+// process died while formatting, once the others have waited 2 seconds for it. Pointers
+// differ between processes, so objects are handed over as offsets: my_offset_of() turns a
+// pointer into the heap into its offset (0 for NULL) and my_ptr_at() turns it back, on
+// persistent heaps too. Every process must open the region as shared, and a process that
+// dies inside a heap call leaves the heap locked.
+void *my_setup_shared(enum malloc_type type, size_t mem_size, int fd);
+size_t my_offset_of(void *ptr);
+void *my_ptr_at(size_t offset);
+
+// Object caches: every cache hands out objects of one size and alignment from slabs of
+// its own, with no header in front of the objects. ctor runs on every object when its
+// slab is created and dtor when the slab is given back, not on every alloc and free, so
+// objects keep their constructed state while they sit free in the cache. The last slab
+// of a cache is kept even when empty. Either function may be NULL, align 0 means 8.
+// Creating a cache fails with a size of 0, an align that is not a power of two, or a
+// slab that would not fit in the heap. Caches must be destroyed before the heap they
+// were created on.
+my_cache_t *my_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *obj), void (*dtor)(void *obj));
+void *my_cache_alloc(my_cache_t *cache);
+void my_cache_free(my_cache_t *cache, void *obj);
+void my_cache_destroy(my_cache_t *cache);
+
+// Heap instances: every heap has its own buddy tree and slab descriptor table over its
+// own region, and my_heap_destroy() releases all of its bookkeeping in one call.
+// The APIs above work on a default heap created by my_setup().
+my_heap_t *my_heap_create(enum malloc_type type, size_t mem_size, void *start_of_memory);
+my_heap_t *my_heap_create_hugepage(enum malloc_type type, size_t mem_size, enum hugepage_mode mode);
+my_heap_t *my_heap_create_numa(enum malloc_type type, size_t mem_size, void *start_of_memory);
+my_heap_t *my_heap_open_file(enum malloc_type type, size_t mem_size, int fd);
+my_heap_t *my_heap_open_shared(enum malloc_type type, size_t mem_size, int fd);
+void *my_heap_malloc(my_heap_t *heap, size_t size);
+void *my_heap_malloc_node(my_heap_t *heap, size_t size, int node);
+void *my_heap_malloc_hint(my_heap_t *heap, size_t size, enum lifetime_hint lifetime);
+void my_heap_free(my_heap_t *heap, void *ptr);
+my_handle_t my_heap_malloc_movable(my_heap_t *heap, size_t size);
+void *my_heap_pin(my_heap_t *heap, my_handle_t handle);
+void my_heap_unpin(my_heap_t *heap, my_handle_t handle);
+void my_heap_free_movable(my_heap_t *heap, my_handle_t handle);
+long my_heap_compact(my_heap_t *heap, long budget);
+void my_heap_destroy(my_heap_t *heap);
+void my_heap_set_lazy_coalescing(my_heap_t *heap, bool enabled, int watermark);
+void my_heap_set_headerless(my_heap_t *heap, bool enabled);
+void my_heap_set_decay(my_heap_t *heap, int idle_ops, bool lazy_free);
+long my_heap_release_idle_memory(my_heap_t *heap);
+void my_heap_set_segregated_placement(my_heap_t *heap, bool enabled);
+void my_heap_set_thread_safe(my_heap_t *heap, bool enabled);
+void my_heap_set_magazines(my_heap_t *heap, bool enabled);
+my_cache_t *my_heap_cache_create(my_heap_t *heap, const char *name, size_t size, size_t align, void (*ctor)(void *obj), void (*dtor)(void *obj));
+void my_heap_set_heap_profiling(my_heap_t *heap, long sample_interval);
+bool my_heap_dump_heap_profile(my_heap_t *heap, const char *path);
+void my_heap_set_root(my_heap_t *heap, void *ptr);
+void *my_heap_get_root(my_heap_t *heap);
+bool my_heap_sync(my_heap_t *heap);
+size_t my_heap_offset_of(my_heap_t *heap, void *ptr);
+void *my_heap_ptr_at(my_heap_t *heap, size_t offset);
+double my_heap_fragmentation_index(my_heap_t *heap);
+size_t my_heap_largest_free_block(my_heap_t *heap);
+void my_heap_arena_reset(my_heap_t *heap);
+my_arena_mark_t my_heap_arena_mark(my_heap_t *heap);
+void my_heap_arena_rewind(my_heap_t *heap, my_arena_mark_t mark);
+
 #endif
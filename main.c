@@ -1,4 +1,6 @@
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <libgen.h>
 
 #include <stdio.h>
@@ -9,33 +11,110 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "interface.h"
 
-#define MAX_LINE_LEN 1024
-FILE *output_file;
+// Output formats
+enum output_mode
+{
+    OUTPUT_TEXT = 0,   // result lines, as text
+    OUTPUT_BINARY = 1, // one record per result line: kind, name length, name, int64 offset
+    OUTPUT_DIGEST = 2, // only the 64-bit FNV-1a hash of the text output
+};
+
+// Binary record kinds
+#define RECORD_FIRST_CHUNK 'S'
+#define RECORD_CHUNK 'C'
+#define RECORD_ALLOC_ERROR 'E'
+#define RECORD_FREE 'F'
+
+// Output is kept in memory and written with a single write() at the end
+struct output
+{
+    enum output_mode mode;
+    char *data;      // buffered text or binary records
+    size_t len;      // bytes used in data
+    size_t cap;      // bytes allocated for data
+    uint64_t digest; // running FNV-1a hash of the text output
+};
+struct output out;
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// Longest name accepted in the input file
+#define MAX_NAME_LEN 255
 
 struct handle
 {
-    char name;           // name
     void **addresses;    // list of addresses returned from my_malloc()
     int num_allocs;      // number of allocations
-    struct handle *next; // pointer to next entry
+    int num_slots;       // number of requests of the 'M' line (threaded replay only)
+    struct handle *next; // next (later) handle with the same name
 };
 typedef struct handle handle_t;
 
+// One entry per distinct name, indexed by the id the name was interned as
+struct name_entry
+{
+    const char *name; // name, pointing into the mapped input file
+    int name_len;     // length of name
+    handle_t *first;  // first handle saved under this name, the one 'F' requests use
+    handle_t *last;   // last handle saved under this name
+};
+
+// Names are interned through an open addressed hash table of ids, and every
+// handle lookup after that is a direct index into names
+struct handle_table
+{
+    int *slots;               // name id per slot, -1 if the slot is empty
+    int slot_count;           // number of slots, a power of two
+    struct name_entry *names; // entries, indexed by name id
+    int name_count;           // number of distinct names
+    int name_capacity;        // entries allocated in names
+    int handle_count;         // number of handles saved across all names
+};
+typedef struct handle_table handle_table_t;
+
 struct ops
 {
-    char name;  // name
-    int numops; // number of allocation requests OR index
-    char type;  // 'M' OR 'F'
-    int size;   // size of allocation request
+    const char *name; // name, pointing into the mapped input file
+    int name_len;     // length of name
+    int numops;       // number of allocation requests OR index
+    char type;        // 'M' OR 'F'
+    int size;         // size of allocation request
+    int name_id;      // id the name was interned as (threaded replay only)
 };
 typedef struct ops ops_t;
 
-bool read_next_op(FILE *fd, ops_t *op);
-void call_my_malloc(handle_t **handles, ops_t *op, void *RAM);
-void call_my_free(handle_t *handles, ops_t *op, void *RAM);
+// One replay thread, with its own heap over its own part of RAM. Every name is replayed
+// by one thread, so the requests of a name keep their order and free from its own heap
+struct replay_thread
+{
+    pthread_t thread;        // thread id
+    int index;               // thread number
+    ops_t *ops;              // requests of the names this thread replays, in trace order
+    long op_count;           // number of requests in ops
+    long op_capacity;        // requests allocated in ops
+    handle_table_t *handles; // handles of every name, only touched by the name's thread
+    my_heap_t *heap;         // heap of this thread
+    long calls;              // my_heap_malloc()/my_heap_free() calls made
+    long total_ns;           // time spent in those calls
+    long max_ns;             // longest of those calls
+    long failed;             // failed allocations
+};
+
+bool read_next_op(const char **cursor, const char *end, ops_t *op);
+int intern_name(handle_table_t *table, const char *name, int name_len);
+void call_my_malloc(handle_table_t *handles, ops_t *op, void *RAM);
+void call_my_free(handle_table_t *handles, ops_t *op, void *RAM);
+void destroy_handle_table(handle_table_t *handles);
+void emit_result(char kind, const char *name, int name_len, long offset);
+int replay_threaded(int type, const char *input, size_t input_len, int thread_count, void *RAM, size_t RAM_SIZE);
+bool flush_output(const char *filename);
 
 // Main function
 // Read input file and call functions accordingly
@@ -44,62 +123,125 @@ int main(int argc, char *argv[])
     printf("%s: Hello Project 2!\n", __func__);
     if (argc < 3)
     {
-        fprintf(stderr, "Not enough parameters specified.  Usage: ./proj2 <allocation_type> <input_file>\n");
+        fprintf(stderr, "Not enough parameters specified.  Usage: ./proj2 <allocation_type> <input_file> [text|binary|digest] [threads]\n");
         fprintf(stderr, "  Allocation type: 0 - Buddy Allocator\n");
         fprintf(stderr, "  Allocation type: 1 - Slab Allocator\n");
+        fprintf(stderr, "  Allocation type: 2 - Arena Allocator\n");
+        fprintf(stderr, "  Output: text (default), binary records, or digest (hash of the text output)\n");
+        fprintf(stderr, "  Threads: more than 1 replays the requests on that many threads and reports timings only\n");
         return -1;
     }
 
     // Verify allocator type
     int type = atoi(argv[1]);
-    if (type != MALLOC_BUDDY && type != MALLOC_SLAB)
+    if (type != MALLOC_BUDDY && type != MALLOC_SLAB && type != MALLOC_ARENA)
     {
         fprintf(stderr, "Invalid option\n");
         return -1;
     }
 
-    // Open input file
-    FILE *input_file = fopen(argv[2], "r");
-    if (input_file == NULL)
+    // Verify output mode
+    out.mode = OUTPUT_TEXT;
+    if (argc > 3)
+    {
+        if (strcmp(argv[3], "binary") == 0)
+            out.mode = OUTPUT_BINARY;
+        else if (strcmp(argv[3], "digest") == 0)
+            out.mode = OUTPUT_DIGEST;
+        else if (strcmp(argv[3], "text") != 0)
+        {
+            fprintf(stderr, "Invalid output mode\n");
+            return -1;
+        }
+    }
+    out.digest = FNV_OFFSET_BASIS;
+
+    // Verify thread count
+    int thread_count = 1;
+    if (argc > 4)
+    {
+        thread_count = atoi(argv[4]);
+
+        // every thread needs a heap of at least one chunk
+        if (thread_count < 1 || thread_count > 64 || (MEMORY_SIZE) / thread_count < MIN_MEM_CHUNK_SIZE)
+        {
+            fprintf(stderr, "Invalid thread count\n");
+            return -1;
+        }
+    }
+
+    // Map input file
+    int input_fd = open(argv[2], O_RDONLY);
+    if (input_fd < 0)
     {
-        perror("fopen() error");
+        perror("open() error");
         return errno;
     }
+    struct stat input_stat;
+    if (fstat(input_fd, &input_stat) < 0)
+    {
+        perror("fstat() error");
+        return errno;
+    }
+    size_t input_len = input_stat.st_size;
+    const char *input = NULL;
+    if (input_len > 0)
+    {
+        input = mmap(NULL, input_len, PROT_READ, MAP_PRIVATE, input_fd, 0);
+        if (input == MAP_FAILED)
+        {
+            perror("mmap() error");
+            return errno;
+        }
+        madvise((void *)input, input_len, MADV_SEQUENTIAL);
+    }
 
-    // Open output file
+    // Output file name
     char output_filename[512] = {0};
     mkdir("output", 0755);
     strcat(output_filename, "output/result-");
     strcat(output_filename, argv[1]);
     strcat(output_filename, "-");
     strcat(output_filename, basename(argv[2]));
-    output_file = fopen(output_filename, "w");
-    if (output_file == NULL)
-    {
-        perror("fopen() error");
-        return errno;
-    }
+    if (out.mode == OUTPUT_BINARY)
+        strcat(output_filename, ".bin");
+    else if (out.mode == OUTPUT_DIGEST)
+        strcat(output_filename, ".digest");
 
     // Print #define macro info
     printf("%s: MEMORY_SIZE: %d, HEADER_SIZE: %d, MIN_MEM_CHUNK_SIZE: %d, N_OBJS_PER_SLAB: %d\n",
            __func__, MEMORY_SIZE, HEADER_SIZE, MIN_MEM_CHUNK_SIZE, N_OBJS_PER_SLAB);
 
     // Allocate memory and setup your memory allocator
-    int RAM_SIZE = MEMORY_SIZE;
+    size_t RAM_SIZE = MEMORY_SIZE;
     void *RAM = malloc(RAM_SIZE);
     if (RAM == NULL)
     {
         perror("malloc() error");
         return errno;
     }
+
+    // Threaded replay gives every thread its own heap and writes no output file
+    if (thread_count > 1)
+    {
+        int status = replay_threaded(type, input, input_len, thread_count, RAM, RAM_SIZE);
+        if (input != NULL)
+            munmap((void *)input, input_len);
+        close(input_fd);
+        free(RAM);
+        printf("%s: Bye!\n", __func__);
+        return status;
+    }
+
     my_setup(type, RAM_SIZE, RAM);
 
-    // List of handles
-    handle_t *handles = NULL;
+    // Table of handles, by name
+    handle_table_t handles = {0};
 
     // Read operation and call interface function
     ops_t *op = (ops_t *)malloc(sizeof(ops_t));
-    while (read_next_op(input_file, op))
+    const char *cursor = input;
+    while (read_next_op(&cursor, input + input_len, op))
     {
         if (op->type == 'M')
         {
@@ -107,7 +249,7 @@ int main(int argc, char *argv[])
         }
         else if (op->type == 'F')
         {
-            call_my_free(handles, op, RAM);
+            call_my_free(&handles, op, RAM);
         }
         else
         {
@@ -117,8 +259,17 @@ int main(int argc, char *argv[])
         }
     }
 
-    fclose(input_file);
-    fclose(output_file);
+    // Report how scattered the free memory ended up
+    printf("%s: Fragmentation index: %.4f, largest free block: %zu\n",
+           __func__, my_fragmentation_index(), my_largest_free_block());
+
+    if (!flush_output(output_filename))
+        return errno;
+
+    destroy_handle_table(&handles);
+    if (input != NULL)
+        munmap((void *)input, input_len);
+    close(input_fd);
     free(op);
     free(RAM);
 
@@ -127,42 +278,120 @@ int main(int argc, char *argv[])
     return 0;
 }
 
+// Find the '\n' ending the line at p (or end), eight bytes at a time
+static const char *find_line_end(const char *p, const char *end)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    const uint64_t newlines = ones * '\n';
+
+    while (end - p >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+
+        // a byte of x is zero where word has a '\n', and the lowest such byte sets the
+        // high bit of its byte in found
+        uint64_t x = word ^ newlines;
+        uint64_t found = (x - ones) & ~x & highs;
+        if (found)
+        {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return p + (__builtin_ctzll(found) >> 3);
+#else
+            return p + (__builtin_clzll(found) >> 3);
+#endif
+        }
+        p += 8;
+    }
+
+    while (p < end && *p != '\n')
+        p++;
+    return p;
+}
+
+// Return the next space separated token before line_end, NULL if there is none
+static const char *next_token(const char **cursor, const char *line_end, const char **token_end)
+{
+    const char *p = *cursor;
+    while (p < line_end && *p == ' ')
+        p++;
+    if (p == line_end)
+        return NULL;
+
+    const char *token = p;
+    while (p < line_end && *p != ' ')
+        p++;
+    *token_end = p;
+    *cursor = p;
+    return token;
+}
+
+// Parse a token as a decimal integer, like atoi()
+static int parse_int(const char *p, const char *token_end)
+{
+    bool negative = false;
+    if (p < token_end && (*p == '-' || *p == '+'))
+    {
+        negative = (*p == '-');
+        p++;
+    }
+
+    int value = 0;
+    while (p < token_end && *p >= '0' && *p <= '9')
+    {
+        value = value * 10 + (*p - '0');
+        p++;
+    }
+    return negative ? -value : value;
+}
+
 // Read and parse one line
-bool read_next_op(FILE *fd, ops_t *op)
+bool read_next_op(const char **cursor, const char *end, ops_t *op)
 {
-    char line[MAX_LINE_LEN];
-    if (!fgets(line, MAX_LINE_LEN, fd))
+    if (*cursor >= end)
         return false;
 
-    char *token;
-    char delim[2] = " ";
-    char *rest = line;
+    const char *line_end = find_line_end(*cursor, end);
+    const char *p = *cursor;
+    *cursor = (line_end < end) ? line_end + 1 : end;
 
-    token = strtok_r(rest, delim, &rest);
+    const char *token;
+    const char *token_end;
+
+    token = next_token(&p, line_end, &token_end);
     if (token)
-        op->name = *token;
+    {
+        op->name = token;
+        op->name_len = token_end - token;
+    }
     else
         goto err;
 
-    token = strtok_r(rest, delim, &rest);
+    token = next_token(&p, line_end, &token_end);
     if (token)
-        op->numops = atoi(token);
+        op->numops = parse_int(token, token_end);
     else
         goto err;
 
-    token = strtok_r(rest, delim, &rest);
+    token = next_token(&p, line_end, &token_end);
     if (token)
         op->type = *token;
     else
         goto err;
 
-    token = strtok_r(rest, delim, &rest);
+    token = next_token(&p, line_end, &token_end);
     if (token)
-        op->size = atoi(token);
-    // else
-    // 	goto err;
+        op->size = parse_int(token, token_end);
+    else
+        op->size = 0;
 
     // Request (input file) validation
+    if (op->name_len > MAX_NAME_LEN)
+    {
+        fprintf(stderr, "%s: Name too long in input file.\n", __func__);
+        exit(EXIT_FAILURE);
+    }
     if (op->type != 'M' && op->type != 'F')
     {
         fprintf(stderr, "%s: Invalid type in input file.\n", __func__);
@@ -186,35 +415,90 @@ err:
     exit(EXIT_FAILURE);
 }
 
-// Save operation in list and call my_malloc() accordingly
-void call_my_malloc(handle_t **handles, ops_t *op, void *RAM)
+// Hash a name with 32-bit FNV-1a
+static unsigned int hash_name(const char *name, int name_len)
 {
-    bool first = false;
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < name_len; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash;
+}
 
-    // Allocate an handle for this operation
-    handle_t *new_entry;
-    new_entry = (handle_t *)malloc(sizeof(handle_t));
-    new_entry->name = op->name;
-    new_entry->num_allocs = 0;
-    new_entry->addresses = (void **)malloc(sizeof(void *) * (op->numops + 1));
-    new_entry->next = NULL;
+// Double the slot array and re-insert every name id
+static void grow_handle_table(handle_table_t *table)
+{
+    int slot_count = (table->slot_count == 0) ? 256 : table->slot_count * 2;
+    int *slots = (int *)malloc(sizeof(int) * slot_count);
+    if (slots == NULL)
+    {
+        perror("malloc() error");
+        exit(EXIT_FAILURE);
+    }
+    memset(slots, -1, sizeof(int) * slot_count);
 
-    // Add to handles list
-    handle_t *temp = *handles;
-    if (temp == NULL)
+    for (int id = 0; id < table->name_count; id++)
     {
-        *handles = new_entry;
-        first = true;
+        struct name_entry *entry = &table->names[id];
+        unsigned int slot = hash_name(entry->name, entry->name_len) & (slot_count - 1);
+        while (slots[slot] != -1)
+            slot = (slot + 1) & (slot_count - 1);
+        slots[slot] = id;
     }
-    else
+
+    free(table->slots);
+    table->slots = slots;
+    table->slot_count = slot_count;
+}
+
+// Return the id of a name, adding it to the table if it was not seen before
+int intern_name(handle_table_t *table, const char *name, int name_len)
+{
+    // Keep the table at most half full
+    if (2 * (table->name_count + 1) > table->slot_count)
+        grow_handle_table(table);
+
+    unsigned int slot = hash_name(name, name_len) & (table->slot_count - 1);
+    while (table->slots[slot] != -1)
+    {
+        struct name_entry *entry = &table->names[table->slots[slot]];
+        if (entry->name_len == name_len && memcmp(entry->name, name, name_len) == 0)
+            return table->slots[slot];
+        slot = (slot + 1) & (table->slot_count - 1);
+    }
+
+    if (table->name_count == table->name_capacity)
     {
-        while (temp->next != NULL)
+        table->name_capacity = (table->name_capacity == 0) ? 256 : table->name_capacity * 2;
+        table->names = (struct name_entry *)realloc(table->names, sizeof(struct name_entry) * table->name_capacity);
+        if (table->names == NULL)
         {
-            temp = temp->next;
+            perror("realloc() error");
+            exit(EXIT_FAILURE);
         }
-        temp->next = new_entry;
     }
 
+    int id = table->name_count++;
+    table->names[id].name = name;
+    table->names[id].name_len = name_len;
+    table->names[id].first = NULL;
+    table->names[id].last = NULL;
+    table->slots[slot] = id;
+    return id;
+}
+
+// Save operation in the handle table and call my_malloc() accordingly
+void call_my_malloc(handle_table_t *handles, ops_t *op, void *RAM)
+{
+    // Only the very first handle of the run is reported as the first chunk
+    bool first = (handles->handle_count == 0);
+
+    // Allocate an handle for this operation
+    handle_t *new_entry;
+    new_entry = (handle_t *)malloc(sizeof(handle_t));
+    new_entry->num_allocs = 0;
+    new_entry->addresses = (void **)malloc(sizeof(void *) * (op->numops + 1));
+    new_entry->next = NULL;
+
     // For given NumOps, try to allocate memory
     for (int i = 1; i <= op->numops; i++)
     {
@@ -223,19 +507,8 @@ void call_my_malloc(handle_t **handles, ops_t *op, void *RAM)
         {
             // my_malloc() request failed
 
-            if (new_entry != NULL && new_entry->num_allocs == 0)
-            {
-                free(new_entry->addresses);
-                free(new_entry);
-
-                if (temp)
-                    temp->next = NULL;
-                else
-                    *handles = NULL;
-            }
-
-            // Print the error to output_file
-            fprintf(output_file, "Allocation Error %c\n", op->name);
+            // Print the error to output
+            emit_result(RECORD_ALLOC_ERROR, op->name, op->name_len, 0);
             break;
         }
         else
@@ -246,42 +519,371 @@ void call_my_malloc(handle_t **handles, ops_t *op, void *RAM)
             *(new_entry->addresses + i) = x;
             new_entry->num_allocs += 1;
 
-            // Print to output_file
+            // Print to output
             if (first)
-                fprintf(output_file, "Start of first Chunk %c is: %d\n", op->name, (int)((void *)(*(new_entry->addresses + i)) - RAM));
+                emit_result(RECORD_FIRST_CHUNK, op->name, op->name_len, (long)((void *)(*(new_entry->addresses + i)) - RAM));
             else
-                fprintf(output_file, "Start of Chunk %c is: %d\n", op->name, (int)((void *)(*(new_entry->addresses + i)) - RAM));
+                emit_result(RECORD_CHUNK, op->name, op->name_len, (long)((void *)(*(new_entry->addresses + i)) - RAM));
         }
     }
+
+    // A handle that got nothing is not kept
+    if (new_entry->num_allocs == 0)
+    {
+        free(new_entry->addresses);
+        free(new_entry);
+        return;
+    }
+
+    // Add to the handles of this name
+    int id = intern_name(handles, op->name, op->name_len);
+    struct name_entry *entry = &handles->names[id];
+    if (entry->first == NULL)
+        entry->first = new_entry;
+    else
+        entry->last->next = new_entry;
+    entry->last = new_entry;
+    handles->handle_count += 1;
+}
+
+// Look up the first handle saved under the name and call my_free() accordingly
+void call_my_free(handle_table_t *handles, ops_t *op, void *RAM)
+{
+    int id = intern_name(handles, op->name, op->name_len);
+    handle_t *hp1 = handles->names[id].first;
+    if (hp1 == NULL)
+        return;
+
+    // entry found in handle table
+    int index = op->numops;
+    void *ptr_to_free = *(hp1->addresses + index);
+    if (ptr_to_free == NULL)
+    {
+        fprintf(stderr, "%s: Invalid 'F' request in input file.\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+
+    my_free(ptr_to_free);
+
+    // The ptr is now freed
+    *(hp1->addresses + index) = NULL;
+    hp1->num_allocs -= 1;
+
+    // Print to output
+    emit_result(RECORD_FREE, op->name, op->name_len, (long)((void *)(ptr_to_free)-RAM));
 }
 
-// Search for corresponding name in list and call my_free() accordingly
-void call_my_free(handle_t *handles, ops_t *op, void *RAM)
+// Free every handle and the table itself
+void destroy_handle_table(handle_table_t *handles)
 {
-    handle_t *hp1 = handles;
-    while (hp1 != NULL)
+    for (int id = 0; id < handles->name_count; id++)
     {
-        if (hp1->name == op->name)
+        handle_t *hp1 = handles->names[id].first;
+        while (hp1 != NULL)
         {
-            // entry found in handle list
-            int index = op->numops;
-            void *ptr_to_free = *(hp1->addresses + index);
-            if (ptr_to_free == NULL)
+            handle_t *next = hp1->next;
+            free(hp1->addresses);
+            free(hp1);
+            hp1 = next;
+        }
+    }
+    free(handles->names);
+    free(handles->slots);
+}
+
+// Monotonic clock in nanoseconds
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Account one allocator call to a replay thread
+static void record_call(struct replay_thread *self, long start_ns)
+{
+    long elapsed = now_ns() - start_ns;
+    self->calls += 1;
+    self->total_ns += elapsed;
+    if (elapsed > self->max_ns)
+        self->max_ns = elapsed;
+}
+
+// Replay the requests of the thread's names, with the handle rules of the serial replay:
+// a handle that got nothing is not kept, and 'F' requests free from the first handle kept
+// under the name. A slot whose allocation failed is skipped, since the heaps are smaller
+// than the serial replay's
+static void *replay_worker(void *arg)
+{
+    struct replay_thread *self = (struct replay_thread *)arg;
+
+    for (long i = 0; i < self->op_count; i++)
+    {
+        ops_t *op = &self->ops[i];
+        struct name_entry *entry = &self->handles->names[op->name_id];
+
+        if (op->type == 'M')
+        {
+            handle_t *new_entry = (handle_t *)malloc(sizeof(handle_t));
+            new_entry->addresses = (void **)calloc(op->numops + 1, sizeof(void *));
+            new_entry->num_allocs = 0;
+            new_entry->num_slots = op->numops;
+            new_entry->next = NULL;
+            for (int k = 1; k <= op->numops; k++)
+            {
+                long start = now_ns();
+                void *x = my_heap_malloc(self->heap, op->size);
+                record_call(self, start);
+                if (x == NULL)
+                {
+                    self->failed += 1;
+                    break;
+                }
+                new_entry->addresses[k] = x;
+                new_entry->num_allocs += 1;
+            }
+
+            if (new_entry->num_allocs == 0)
+            {
+                free(new_entry->addresses);
+                free(new_entry);
+                continue;
+            }
+            if (entry->first == NULL)
+                entry->first = new_entry;
+            else
+                entry->last->next = new_entry;
+            entry->last = new_entry;
+        }
+        else
+        {
+            handle_t *hp1 = entry->first;
+            if (hp1 == NULL)
+                continue;
+            if (op->numops > hp1->num_slots)
             {
                 fprintf(stderr, "%s: Invalid 'F' request in input file.\n", __func__);
                 exit(EXIT_FAILURE);
             }
 
-            my_free(ptr_to_free);
-
-            // The ptr is now freed
-            *(hp1->addresses + index) = NULL;
+            void *ptr_to_free = hp1->addresses[op->numops];
+            if (ptr_to_free == NULL)
+                continue;
+            hp1->addresses[op->numops] = NULL;
             hp1->num_allocs -= 1;
 
-            // Print to output_file
-            fprintf(output_file, "freed object %c at %d\n", op->name, (int)((void *)(ptr_to_free)-RAM));
-            break;
+            long start = now_ns();
+            my_heap_free(self->heap, ptr_to_free);
+            record_call(self, start);
+        }
+    }
+    return NULL;
+}
+
+// Replay the requests on thread_count threads and print throughput and latency
+int replay_threaded(int type, const char *input, size_t input_len, int thread_count, void *RAM, size_t RAM_SIZE)
+{
+    // Read the whole trace first, dealing every name with its requests to one thread
+    handle_table_t handles = {0};
+    struct replay_thread *threads = (struct replay_thread *)calloc(thread_count, sizeof(struct replay_thread));
+    const char *cursor = input;
+    ops_t op;
+    while (read_next_op(&cursor, input + input_len, &op))
+    {
+        op.name_id = intern_name(&handles, op.name, op.name_len);
+        struct replay_thread *owner = &threads[op.name_id % thread_count];
+        if (owner->op_count == owner->op_capacity)
+        {
+            owner->op_capacity = (owner->op_capacity == 0) ? 1024 : owner->op_capacity * 2;
+            owner->ops = (ops_t *)realloc(owner->ops, sizeof(ops_t) * owner->op_capacity);
+            if (owner->ops == NULL)
+            {
+                perror("realloc() error");
+                exit(EXIT_FAILURE);
+            }
+        }
+        owner->ops[owner->op_count++] = op;
+    }
+
+    // Every thread gets the same power of two part of RAM as its own heap
+    size_t part_size = (size_t)1 << (63 - __builtin_clzl(RAM_SIZE / thread_count));
+    for (int t = 0; t < thread_count; t++)
+    {
+        threads[t].index = t;
+        threads[t].handles = &handles;
+        threads[t].heap = my_heap_create(type, part_size, RAM + t * part_size);
+    }
+
+    long start = now_ns();
+    for (int t = 0; t < thread_count; t++)
+    {
+        if (pthread_create(&threads[t].thread, NULL, replay_worker, &threads[t]) != 0)
+        {
+            perror("pthread_create() error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int t = 0; t < thread_count; t++)
+        pthread_join(threads[t].thread, NULL);
+    long elapsed = now_ns() - start;
+
+    // Report
+    long calls = 0;
+    for (int t = 0; t < thread_count; t++)
+        calls += threads[t].calls;
+    printf("%s: %ld calls on %d threads in %.3f ms, %.0f calls/s\n",
+           __func__, calls, thread_count, elapsed / 1e6, (elapsed > 0) ? calls * 1e9 / elapsed : 0.0);
+    for (int t = 0; t < thread_count; t++)
+    {
+        struct replay_thread *thread = &threads[t];
+        printf("%s: Thread %d: %ld calls, mean latency %.0f ns, max latency %ld ns, %ld failed allocations\n",
+               __func__, t, thread->calls, (thread->calls > 0) ? (double)thread->total_ns / thread->calls : 0.0,
+               thread->max_ns, thread->failed);
+    }
+
+    for (int t = 0; t < thread_count; t++)
+    {
+        my_heap_destroy(threads[t].heap);
+        free(threads[t].ops);
+    }
+    free(threads);
+    destroy_handle_table(&handles);
+    return 0;
+}
+
+// Append bytes to the output buffer
+static void output_append(const void *bytes, size_t len)
+{
+    if (out.len + len > out.cap)
+    {
+        out.cap = (out.cap == 0) ? (1 << 20) : out.cap * 2;
+        while (out.len + len > out.cap)
+            out.cap *= 2;
+        out.data = realloc(out.data, out.cap);
+        if (out.data == NULL)
+        {
+            perror("realloc() error");
+            exit(EXIT_FAILURE);
         }
-        hp1 = hp1->next;
     }
+    memcpy(out.data + out.len, bytes, len);
+    out.len += len;
+}
+
+// Append a decimal integer to a line being built, return the new end of the line
+static char *format_int(char *p, long value)
+{
+    char digits[20];
+    int n = 0;
+    unsigned long magnitude = (value < 0) ? -(unsigned long)value : (unsigned long)value;
+    do
+    {
+        digits[n++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    if (value < 0)
+        *p++ = '-';
+    while (n > 0)
+        *p++ = digits[--n];
+    return p;
+}
+
+// Record one result line in the selected output format
+void emit_result(char kind, const char *name, int name_len, long offset)
+{
+    if (out.mode == OUTPUT_BINARY)
+    {
+        int64_t record_offset = offset;
+        char record[2 + MAX_NAME_LEN + sizeof(int64_t)];
+        record[0] = kind;
+        record[1] = (char)name_len;
+        memcpy(record + 2, name, name_len);
+        memcpy(record + 2 + name_len, &record_offset, sizeof(int64_t));
+        output_append(record, 2 + name_len + sizeof(int64_t));
+        return;
+    }
+
+    // Build the text line by hand instead of going through printf
+    char line[64 + MAX_NAME_LEN];
+    char *p = line;
+    const char *prefix;
+    const char *middle;
+    switch (kind)
+    {
+    case RECORD_FIRST_CHUNK:
+        prefix = "Start of first Chunk ";
+        middle = " is: ";
+        break;
+    case RECORD_CHUNK:
+        prefix = "Start of Chunk ";
+        middle = " is: ";
+        break;
+    case RECORD_ALLOC_ERROR:
+        prefix = "Allocation Error ";
+        middle = NULL;
+        break;
+    default:
+        prefix = "freed object ";
+        middle = " at ";
+        break;
+    }
+    size_t prefix_len = strlen(prefix);
+    memcpy(p, prefix, prefix_len);
+    p += prefix_len;
+    memcpy(p, name, name_len);
+    p += name_len;
+    if (middle != NULL)
+    {
+        size_t middle_len = strlen(middle);
+        memcpy(p, middle, middle_len);
+        p += middle_len;
+        p = format_int(p, offset);
+    }
+    *p++ = '\n';
+
+    if (out.mode == OUTPUT_DIGEST)
+    {
+        for (char *c = line; c < p; c++)
+            out.digest = (out.digest ^ (unsigned char)*c) * FNV_PRIME;
+        return;
+    }
+    output_append(line, p - line);
+}
+
+// Write the whole output file with one write() call (or a few, if it is cut short)
+bool flush_output(const char *filename)
+{
+    if (out.mode == OUTPUT_DIGEST)
+    {
+        char line[32];
+        int len = snprintf(line, sizeof(line), "%016llx\n", (unsigned long long)out.digest);
+        output_append(line, len);
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("open() error");
+        return false;
+    }
+
+    size_t written = 0;
+    while (written < out.len)
+    {
+        ssize_t n = write(fd, out.data + written, out.len - written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("write() error");
+            close(fd);
+            return false;
+        }
+        written += n;
+    }
+
+    close(fd);
+    free(out.data);
+    return true;
 }
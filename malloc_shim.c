@@ -0,0 +1,306 @@
+// for RTLD_NEXT
+#define _GNU_SOURCE
+#include "interface.h"
+#include "my_memory.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+
+// LD_PRELOAD shim: exports malloc, free, calloc, realloc, posix_memalign and
+// malloc_usable_size backed by the allocator, so that unmodified programs can run on it.
+// Build with `make shim` and run with LD_PRELOAD=./libmyalloc.so.
+//
+// MY_ALLOC_POLICY - "buddy" (default) or "slab"
+// MY_ALLOC_SIZE   - bytes of memory to map for the allocator (default 256 MiB, at most 64 GiB)
+//
+// In buddy mode every request goes to a header-less buddy heap. In slab mode requests of
+// up to SHIM_SLAB_MAX_SIZE bytes go to a slab heap over half of the memory and the rest to
+// a header-less buddy heap over the other half. Requests the heaps cannot serve, calls
+// made while the allocator itself is allocating its bookkeeping, and calls made before
+// the heaps are ready go to glibc, and frees of memory outside the heaps go back there.
+
+#define SHIM_DEFAULT_SIZE (256L * 1024 * 1024)
+#define SHIM_MAX_SIZE (64L * 1024 * 1024 * 1024)
+#define SHIM_SLAB_MAX_SIZE 4096
+#define SHIM_ALIGNMENT 16
+
+// Setup states of the shim
+#define SHIM_UNINITIALIZED 0
+#define SHIM_INITIALIZING 1
+#define SHIM_READY 2
+#define SHIM_FAILED 3
+
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+// Global Data
+static int shimState = SHIM_UNINITIALIZED;
+static my_heap_t* buddyHeap;
+static my_heap_t* slabHeap;
+static void* regionStart;
+static void* regionEnd;
+
+// set while a thread is inside the allocator, so that its own bookkeeping goes to glibc
+static __thread bool inAllocator;
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shim_ready
+// Description  : sets up the heaps on the first call. only one thread sets them up,
+//                the others use glibc until they are ready
+//
+// Inputs       : None
+// Outputs      : true if the heaps can be used
+
+static bool shim_ready(void)
+{
+    int state = __atomic_load_n(&shimState, __ATOMIC_ACQUIRE);
+    if (state == SHIM_READY){
+        return true;
+    }
+    if (state != SHIM_UNINITIALIZED){
+        return false;
+    }
+
+    int expected = SHIM_UNINITIALIZED;
+    if (!__atomic_compare_exchange_n(&shimState, &expected, SHIM_INITIALIZING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        return false;
+    }
+
+    long size = SHIM_DEFAULT_SIZE;
+    const char* sizeEnv = getenv("MY_ALLOC_SIZE");
+    if (sizeEnv != NULL){
+        size = strtol(sizeEnv, NULL, 0);
+    }
+    if ((size < 2 * MIN_MEM_CHUNK_SIZE) || (size > SHIM_MAX_SIZE)){
+        size = SHIM_DEFAULT_SIZE;
+    }
+    size = 1L << (63 - __builtin_clzl(size));
+
+    const char* policyEnv = getenv("MY_ALLOC_POLICY");
+    bool useSlabs = (policyEnv != NULL) && (strcmp(policyEnv, "slab") == 0);
+
+    // the heaps' bookkeeping comes from glibc while they are set up
+    inAllocator = true;
+    void* mappedRegion;
+    size_t mappedSize;
+    regionStart = map_region(size, HUGEPAGE_NONE, &mappedRegion, &mappedSize);
+    if (regionStart == NULL){
+        inAllocator = false;
+        __atomic_store_n(&shimState, SHIM_FAILED, __ATOMIC_RELEASE);
+        return false;
+    }
+    regionEnd = regionStart + size;
+
+    long buddySize = useSlabs ? size / 2 : size;
+    buddyHeap = my_heap_create(MALLOC_BUDDY, buddySize, regionStart + (size - buddySize));
+    my_heap_set_headerless(buddyHeap, true);
+    my_heap_set_thread_safe(buddyHeap, true);
+    if (useSlabs){
+        slabHeap = my_heap_create(MALLOC_SLAB, size / 2, regionStart);
+        my_heap_set_thread_safe(slabHeap, true);
+    }
+    inAllocator = false;
+
+    __atomic_store_n(&shimState, SHIM_READY, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : heap_of
+// Description  : finds which of the shim's heaps manages the given address
+//
+//
+// Inputs       : ptr - any pointer
+// Outputs      : the heap containing ptr
+//              : NULL if ptr did not come from the heaps
+
+static my_heap_t* heap_of(void *ptr)
+{
+    if ((__atomic_load_n(&shimState, __ATOMIC_ACQUIRE) != SHIM_READY) || (ptr < regionStart) || (ptr >= regionEnd)){
+        return NULL;
+    }
+    if ((slabHeap != NULL) && (ptr < regionStart + (regionEnd - regionStart) / 2)){
+        return slabHeap;
+    }
+    return buddyHeap;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shim_malloc
+// Description  : allocates from the heaps, keeping the 16 byte alignment malloc promises.
+//                buddy chunks are at least MIN_MEM_CHUNK_SIZE aligned, slab objects are
+//                sized so that header and object add up to a multiple of 16
+//
+// Inputs       : size - number of bytes asked for
+//              : buddyOnly - boolean for whether small requests must also come from the buddy heap
+// Outputs      : pointer to the memory
+//              : NULL if the heaps are not ready or have no room
+
+static void* shim_malloc(size_t size, bool buddyOnly)
+{
+    if (inAllocator || !shim_ready() || (size > SHIM_MAX_SIZE)){
+        return NULL;
+    }
+
+    void* memAddr;
+    inAllocator = true;
+    if ((slabHeap != NULL) && !buddyOnly && (size <= SHIM_SLAB_MAX_SIZE)){
+        size_t objSize = (size + HEADER_SIZE + SHIM_ALIGNMENT - 1) & ~(SHIM_ALIGNMENT - 1);
+        memAddr = my_heap_malloc(slabHeap, objSize - HEADER_SIZE);
+    } else {
+        memAddr = my_heap_malloc(buddyHeap, size);
+    }
+    inAllocator = false;
+    return memAddr;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shim_usable_size
+// Description  : returns how many bytes can be used at a pointer from the heaps, the
+//                chunk's size from the buddy side table or the object size from its header
+//
+// Inputs       : heap - heap the pointer came from
+//              : ptr - pointer returned by shim_malloc
+// Outputs      : number of usable bytes
+
+static size_t shim_usable_size(my_heap_t *heap, void *ptr)
+{
+    if (heap == slabHeap){
+        return get_size_in_header(ptr, HEADER_SIZE);
+    }
+    return (size_t)1 << get_chunk_order(heap->buddyTree, ptr);
+}
+
+
+void *malloc(size_t size)
+{
+    void* memAddr = shim_malloc(size, false);
+    if (memAddr == NULL){
+        return __libc_malloc(size);
+    }
+    return memAddr;
+}
+
+
+void free(void *ptr)
+{
+    if (ptr == NULL){
+        return;
+    }
+
+    my_heap_t* heap = heap_of(ptr);
+    if (heap == NULL){
+        __libc_free(ptr);
+        return;
+    }
+
+    // a free from inside the allocator is always of glibc memory, so it never gets here
+    inAllocator = true;
+    my_heap_free(heap, ptr);
+    inAllocator = false;
+}
+
+
+void *calloc(size_t count, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)){
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // reused chunks are not zeroed
+    void* memAddr = shim_malloc(total, false);
+    if (memAddr == NULL){
+        return __libc_calloc(count, size);
+    }
+    memset(memAddr, 0, total);
+    return memAddr;
+}
+
+
+void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL){
+        return malloc(size);
+    }
+
+    my_heap_t* heap = heap_of(ptr);
+    if (heap == NULL){
+        return __libc_realloc(ptr, size);
+    }
+    if (size == 0){
+        free(ptr);
+        return NULL;
+    }
+
+    // shrinking, or growing within the chunk, keeps the memory where it is
+    size_t oldSize = shim_usable_size(heap, ptr);
+    if (size <= oldSize){
+        return ptr;
+    }
+
+    void* memAddr = malloc(size);
+    if (memAddr == NULL){
+        return NULL;
+    }
+    memcpy(memAddr, ptr, oldSize);
+    free(ptr);
+    return memAddr;
+}
+
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if ((alignment < sizeof(void*)) || ((alignment & (alignment - 1)) != 0)){
+        return EINVAL;
+    }
+
+    // a buddy chunk is aligned to its own size relative to the start of its heap, and the
+    // heaps are only known to start on a huge page, so alignments above that go to glibc
+    void* memAddr = NULL;
+    if (alignment <= SHIM_ALIGNMENT){
+        memAddr = shim_malloc(size, false);
+    } else if (alignment <= HUGE_PAGE_SIZE){
+        memAddr = shim_malloc((size > alignment) ? size : alignment, true);
+    }
+    if (memAddr == NULL){
+        memAddr = __libc_memalign(alignment, size);
+        if (memAddr == NULL){
+            return ENOMEM;
+        }
+    }
+    *memptr = memAddr;
+    return 0;
+}
+
+
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL){
+        return 0;
+    }
+
+    my_heap_t* heap = heap_of(ptr);
+    if (heap != NULL){
+        return shim_usable_size(heap, ptr);
+    }
+
+    // memory from glibc is measured by glibc
+    static size_t (*libcUsableSize)(void*);
+    if (libcUsableSize == NULL){
+        libcUsableSize = (size_t (*)(void*))dlsym(RTLD_NEXT, "malloc_usable_size");
+    }
+    return (libcUsableSize != NULL) ? libcUsableSize(ptr) : 0;
+}
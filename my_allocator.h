@@ -0,0 +1,503 @@
+#ifndef MY_ALLOCATOR_H
+#define MY_ALLOCATOR_H
+
+#include "my_memory.h"
+
+// Policy implementations of the allocator. The geometry (header size, minimum
+// chunk size, objects per slab) is passed in as arguments so that callers
+// passing constants get every size computation folded at compile time.
+// interface.c uses them with the macros from interface.h, and
+// MY_ALLOCATOR_DEFINE below stamps out separately tuned allocators.
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : buddy_malloc
+// Description  : allocates memory of given size from a buddy system tree
+//
+//
+// Inputs       : buddyTree - tree to allocate the chunk from
+//              : size - number of bytes the user asked for
+//              : lifetime - enum lifetime_hint of the memory, for segregated placement
+//              : headerSize - number of header bytes in front of the user's memory
+//              : minChunkSize - smallest chunk the tree hands out
+// Outputs      : pointer to the start of the user's usable memory
+//              : NULL if there is no hole big enough
+
+static inline void* buddy_malloc(BUDDYTREE* buddyTree, size_t size, enum lifetime_hint lifetime, const int headerSize, const int minChunkSize){
+    // a request bigger than the whole tree can never fit, and could overflow the rounding below
+    if (size > buddyTree->totalMemSize){
+        return NULL;
+    }
+
+    // find out how big of a chunk user will need
+    size_t chunkSize = next_power_of_two(size + headerSize, minChunkSize);
+
+    // add a new node to the tree containing chunksize memory
+    TREENODE* newNode = create_new_memory_node(buddyTree, chunkSize, lifetime);
+
+    if (newNode == NULL){
+        return NULL; // should return -1 here
+    }
+
+    // place the size of the user's memory in the header bytes
+    put_size_in_header(newNode->startAddr + headerSize, size, headerSize);
+
+    // return the start of the user's usable memory
+    return newNode->startAddr + headerSize;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : buddy_free
+// Description  : gives memory returned by buddy_malloc back to the buddy system tree
+//
+//
+// Inputs       : buddyTree - tree the memory was allocated from
+//              : ptr - pointer returned by buddy_malloc
+//              : headerSize - number of header bytes in front of the user's memory
+// Outputs      : None
+
+static inline void buddy_free(BUDDYTREE* buddyTree, void* ptr, const int headerSize){
+    // find the node in the tree trying to be removed
+    TREENODE* removalNode = find_node_by_address(buddyTree->root, ptr - headerSize);
+    FREE_CHECK(removalNode != NULL, "invalid pointer", ptr);
+    FREE_CHECK(removalNode->isMem, "double free", ptr);
+    FREE_CHECK(header_intact(ptr, headerSize), "corrupted header", ptr);
+
+#ifdef MY_HARDENED
+    memset(ptr, POISON_BYTE, get_size_in_header(ptr, headerSize));
+#endif
+
+    // set the node as a hole and merge it (or leave it for later in lazy mode)
+    release_memory_node(buddyTree, removalNode);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : buddy_malloc_headerless
+// Description  : allocates memory of given size from a buddy system tree without a
+//                header, the chunk's order goes in the tree's side table instead. a power
+//                of two request gets a chunk of exactly its own size
+//
+//
+// Inputs       : buddyTree - tree to allocate the chunk from (with an order side table)
+//              : size - number of bytes the user asked for
+//              : lifetime - enum lifetime_hint of the memory, for segregated placement
+//              : minChunkSize - smallest chunk the tree hands out
+// Outputs      : pointer to the start of the user's usable memory
+//              : NULL if there is no hole big enough
+
+static inline void* buddy_malloc_headerless(BUDDYTREE* buddyTree, size_t size, enum lifetime_hint lifetime, const int minChunkSize){
+    if (size > buddyTree->totalMemSize){
+        return NULL;
+    }
+    size_t chunkSize = next_power_of_two(size, minChunkSize);
+
+    TREENODE* newNode = create_new_memory_node(buddyTree, chunkSize, lifetime);
+
+    if (newNode == NULL){
+        return NULL;
+    }
+
+    set_chunk_order(buddyTree, newNode->startAddr, __builtin_ctzl(chunkSize));
+    return newNode->startAddr;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : buddy_free_headerless
+// Description  : gives memory returned by buddy_malloc_headerless back to the buddy system
+//                tree. the chunk's order comes from the tree's side table, which also tells
+//                a live chunk from a freed or foreign pointer before the tree is walked
+//
+//
+// Inputs       : buddyTree - tree the memory was allocated from
+//              : ptr - pointer returned by buddy_malloc_headerless
+// Outputs      : None
+
+static inline void buddy_free_headerless(BUDDYTREE* buddyTree, void* ptr){
+    // chunks start on multiples of the minimum chunk size, nothing else has a table entry
+    long offset = ptr - buddyTree->root->startAddr;
+    FREE_CHECK((offset >= 0) && ((size_t)offset < buddyTree->totalMemSize) && ((offset & ((1L << buddyTree->orderTableShift) - 1)) == 0), "invalid pointer", ptr);
+    int order = get_chunk_order(buddyTree, ptr);
+    FREE_CHECK(order != 0, "invalid pointer or double free", ptr);
+
+    TREENODE* removalNode = find_node_by_address(buddyTree->root, ptr);
+    FREE_CHECK((removalNode != NULL) && removalNode->isMem && (removalNode->size == (size_t)1 << order), "corrupted order table", ptr);
+
+#ifdef MY_HARDENED
+    memset(ptr, POISON_BYTE, (size_t)1 << order);
+#endif
+
+    set_chunk_order(buddyTree, ptr, 0);
+    release_memory_node(buddyTree, removalNode);
+}
+
+
+static inline long slab_flush_magazines(BUDDYTREE* buddyTree, SDTABLE* sdTable, const int headerSize, const int objsPerSlab, bool allThreads);
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : slab_malloc
+// Description  : allocates an object of given size from the slabs of its type,
+//                getting a new slab from the buddy system tree when they are full
+//
+//
+// Inputs       : buddyTree - tree that slabs are allocated from
+//              : sdTable - slab descriptor table holding the slabs of every type
+//              : size - number of bytes the user asked for
+//              : headerSize - number of header bytes in front of each slab and object
+//              : minChunkSize - smallest chunk the tree hands out
+//              : objsPerSlab - number of objects in each slab
+// Outputs      : pointer to the start of the user's usable memory
+//              : NULL if no new slab could be allocated
+
+static inline void* slab_malloc(BUDDYTREE* buddyTree, SDTABLE* sdTable, size_t size, const int headerSize, const int minChunkSize, const int objsPerSlab){
+    // a whole slab of objects has to fit a size_t
+    if (size > (SIZE_MAX - headerSize) / objsPerSlab - headerSize){
+        return NULL;
+    }
+
+    // initialize local variables
+    void* memAddr;
+    size_t objSize = (headerSize + size);
+
+    // check to see if we have a slab descriptor entry in table for this size
+    SDENTRY* sdEntry = sd_table_search(sdTable, objSize);
+
+    // if an entry was found, try to add the new object to the the slab
+    if (sdEntry != NULL){
+        memAddr = add_new_memory_to_slab(sdEntry, headerSize);
+
+        // if the slab is not full, return the found address
+        if (memAddr != NULL){
+            put_size_in_header(memAddr, size, headerSize);
+            return memAddr;
+        }
+    }
+
+    // slab size is made up of slab header and N objs including their headers all rounded up
+    size_t slabSize = next_power_of_two(headerSize + (objSize) * objsPerSlab, minChunkSize);
+
+    // create a new node in the tree containing the memory for the new slab, a slab is
+    // shared by every object of its type so it has no lifetime of its own
+    TREENODE* newSlabNode = create_new_memory_node(buddyTree, slabSize, LIFETIME_DEFAULT);
+
+    if (newSlabNode == NULL){
+        // objects held in magazines may be all that keeps some slabs from being given back
+        if (sdTable->magazines && (slab_flush_magazines(buddyTree, sdTable, headerSize, objsPerSlab, false) > 0)){
+            return slab_malloc(buddyTree, sdTable, size, headerSize, minChunkSize, objsPerSlab);
+        }
+        return NULL; // should return -1 here
+    }
+
+    // check whether a new slab entry for the slab descriptor table must be created or not
+    if (sdEntry == NULL){
+        // since there is no entry in the table for slabs of type objSize, create one and add it to the table
+        sdEntry = init_sd_entry(newSlabNode->startAddr, objSize, objsPerSlab);
+        sd_table_insert(sdTable, sdEntry);
+        set_slab_index(sdTable, newSlabNode->startAddr, sdEntry->slabPtr);
+    } else {
+        // since there is already an entry in the table for slabs of type objSize, jsut add the new slab to the entry
+        set_slab_index(sdTable, newSlabNode->startAddr, add_slab_to_entry(sdEntry, newSlabNode->startAddr));
+    }
+
+    // allocate a spot of memory in the slab
+    memAddr = add_new_memory_to_slab(sdEntry, headerSize);
+
+    put_size_in_header(memAddr, size, headerSize);
+    return memAddr;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : slab_free
+// Description  : gives an object returned by slab_malloc back to its slab, and
+//                gives the slab back to the buddy system tree once it is empty
+//
+//
+// Inputs       : buddyTree - tree that slabs are allocated from
+//              : sdTable - slab descriptor table holding the slabs of every type
+//              : ptr - pointer returned by slab_malloc
+//              : headerSize - number of header bytes in front of each slab and object
+//              : objsPerSlab - number of objects in each slab
+// Outputs      : None
+
+static inline void slab_free(BUDDYTREE* buddyTree, SDTABLE* sdTable, void* ptr, const int headerSize, const int objsPerSlab){
+    FREE_CHECK(header_intact(ptr, headerSize), "corrupted header", ptr);
+
+    // Retrieve information about what we're trying to free
+    size_t type = get_size_in_header(ptr, headerSize);
+    size_t objectSize = (headerSize + type);
+    SDENTRY* entry = sd_table_search(sdTable, objectSize);
+    SLABPTR* slab = NULL;
+    size_t slabSize = headerSize + (objectSize) * objsPerSlab;
+    FREE_CHECK(entry != NULL, "invalid pointer", ptr);
+
+    // Traverse the slabs looking for which contains the chunk we want to free
+    SLABPTR* travPointer = entry->slabPtr;
+    while(travPointer != NULL) {
+    void* slabStartAddress = travPointer->slabStartAddr;
+        if( (ptr > slabStartAddress) && (ptr < slabStartAddress + slabSize) ) {
+            slab = travPointer;
+            break;
+        }
+        travPointer = travPointer->next;
+    }
+    // If there none of our slabs contain what were trying to free
+    FREE_CHECK(slab != NULL, "invalid pointer", ptr);
+
+    int slabBitMapIndex = -1;
+    // Iterate through slab until we find the index of the address we are trying to free
+    for(int i = 0; i < objsPerSlab; i++) {
+        void* chunkAddr = ( slab->slabStartAddr + 2 * headerSize + (i*objectSize) );
+        if(chunkAddr == ptr) {
+            slabBitMapIndex = i;
+            break;
+        }
+    }
+    // This shouldnt happen, but just in case
+    FREE_CHECK(slabBitMapIndex != -1, "pointer into the middle of an object", ptr);
+
+    // A hole can't be freed again
+    FREE_CHECK(slab->slabBitMap[slabBitMapIndex] == 1, "double free", ptr);
+
+#ifdef MY_HARDENED
+    memset(ptr, POISON_BYTE, type);
+#endif
+
+    // Flip the bit to a 0 to represent it as a hole
+    slab->slabBitMap[slabBitMapIndex] = 0;
+
+    // Iterate through slabs bit map to check to see if slab is now empty, objects still
+    // cached in magazines keep it
+    bool emptySlab = true;
+    for(int i = 0; i < objsPerSlab; i++) {
+        if(__atomic_load_n(&slab->slabBitMap[i], __ATOMIC_RELAXED) != 0) {
+            emptySlab = false;
+            break;
+        }
+    }
+
+    // If slab is now empty, remove it from slab linked list and update hole tree
+    if(emptySlab) {
+        TREENODE* removalNode = find_node_by_address(buddyTree->root, slab->slabStartAddr);
+        set_slab_index(sdTable, slab->slabStartAddr, NULL);
+        remove_slab_from_entry(entry, slab);
+        release_memory_node(buddyTree, removalNode);
+    }
+
+    // If there are no longer any slabs corresponing to the type of the memory we freed, delete entry in table
+    if(entry->slabPtr == NULL) {
+        sd_table_delete(sdTable, entry);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : slab_magazine_free
+// Description  : checks an object returned by slab_malloc against its slab and puts it
+//                in the calling thread's magazines, without the heap's lock. the slab is
+//                found through the table's slab index, as slabs are chunks of the tree
+//                aligned to their size
+//
+//
+// Inputs       : sdTable - slab descriptor table holding the slabs of every type
+//              : ptr - pointer returned by slab_malloc
+//              : headerSize - number of header bytes in front of each slab and object
+//              : minChunkSize - smallest chunk the tree hands out
+//              : objsPerSlab - number of objects in each slab
+// Outputs      : None
+
+static inline void slab_magazine_free(SDTABLE* sdTable, void* ptr, const int headerSize, const int minChunkSize, const int objsPerSlab){
+    FREE_CHECK((ptr > sdTable->slabBase) && (ptr < sdTable->slabBase + (sdTable->slabIndexLength << sdTable->slabIndexShift)), "invalid pointer", ptr);
+    FREE_CHECK(header_intact(ptr, headerSize), "corrupted header", ptr);
+
+    // a size no slab of the tree could hold is not from a slab
+    size_t size = get_size_in_header(ptr, headerSize);
+    FREE_CHECK(size < (sdTable->slabIndexLength << sdTable->slabIndexShift) / objsPerSlab, "invalid pointer", ptr);
+    size_t objectSize = headerSize + size;
+    size_t slabSize = next_power_of_two(headerSize + objectSize * objsPerSlab, minChunkSize);
+    void* slabStartAddr = sdTable->slabBase + ((size_t)(ptr - sdTable->slabBase) & ~(slabSize - 1));
+    SLABPTR* slab = slab_at(sdTable, slabStartAddr);
+    FREE_CHECK((slab != NULL) && (slab->type == objectSize), "invalid pointer", ptr);
+
+    size_t objOffset = (size_t)(ptr - (slabStartAddr + 2 * headerSize));
+    FREE_CHECK((ptr >= slabStartAddr + 2 * headerSize) && (objOffset % objectSize == 0) && (objOffset / objectSize < (size_t)objsPerSlab), "pointer into the middle of an object", ptr);
+
+    // a hole, or an object already in a magazine, can't be freed again. the entry is only
+    // set to 1 and back without the lock, so lock holders still see whether it is 0
+    unsigned int* mark = &slab->slabBitMap[objOffset / objectSize];
+    unsigned int used = 1;
+    FREE_CHECK(__atomic_compare_exchange_n(mark, &used, SLAB_OBJ_CACHED, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED), "double free", ptr);
+
+#ifdef MY_HARDENED
+    memset(ptr, POISON_BYTE, size);
+#endif
+
+    // the object is kept in its slab, marked as cached, until its magazine is flushed
+    magazine_free(sdTable, objectSize, ptr, mark);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : slab_empty_magazine
+// Description  : gives every object in a magazine back to its slab
+//
+//
+// Inputs       : buddyTree - tree that slabs are allocated from
+//              : sdTable - slab descriptor table holding the slabs of every type
+//              : magazine - magazine to empty
+//              : headerSize - number of header bytes in front of each slab and object
+//              : objsPerSlab - number of objects in each slab
+// Outputs      : number of objects given back
+
+static inline long slab_empty_magazine(BUDDYTREE* buddyTree, SDTABLE* sdTable, MAGAZINE* magazine, const int headerSize, const int objsPerSlab){
+    for (int i = 0; i < magazine->rounds; i++){
+        // back to used for a moment, so that slab_free takes it like any other object
+        *magazine->marks[i] = 1;
+        slab_free(buddyTree, sdTable, magazine->objs[i], headerSize, objsPerSlab);
+    }
+    long emptied = magazine->rounds;
+    magazine->rounds = 0;
+    return emptied;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : slab_flush_magazines
+// Description  : gives every object held in the depots' magazines and in the calling
+//                thread's (or every thread's) magazines back to its slab, so that empty
+//                slabs go back to the buddy tree. other threads use their magazines
+//                without the lock, so theirs are only flushed once no thread uses the heap
+//
+//
+// Inputs       : buddyTree - tree that slabs are allocated from
+//              : sdTable - slab descriptor table holding the slabs of every type
+//              : headerSize - number of header bytes in front of each slab and object
+//              : objsPerSlab - number of objects in each slab
+//              : allThreads - boolean for whether every thread's magazines are flushed
+// Outputs      : number of objects given back
+
+static inline long slab_flush_magazines(BUDDYTREE* buddyTree, SDTABLE* sdTable, const int headerSize, const int objsPerSlab, bool allThreads){
+    long flushed = 0;
+
+    // freeing the last object of a type deletes its entry, so the depots are taken off first
+    MAGAZINE* magazines = NULL;
+    for (SDENTRY* entry = sdTable->headEntry; entry != NULL; entry = entry->nextEntry){
+        MAGAZINE* magazine = detach_magazines(entry);
+        while (magazine != NULL){
+            MAGAZINE* nextMagazine = magazine->next;
+            magazine->next = magazines;
+            magazines = magazine;
+            magazine = nextMagazine;
+        }
+    }
+    while (magazines != NULL){
+        MAGAZINE* nextMagazine = magazines->next;
+        flushed += slab_empty_magazine(buddyTree, sdTable, magazines, headerSize, objsPerSlab);
+        magazines->next = sdTable->emptyMagazines;
+        sdTable->emptyMagazines = magazines;
+        magazines = nextMagazine;
+    }
+
+    pthread_t self = pthread_self();
+    for (THREADMAGS* threadMagazines = sdTable->threadMagazines; threadMagazines != NULL; threadMagazines = threadMagazines->next){
+        if (allThreads || pthread_equal(threadMagazines->owner, self)){
+            flushed += slab_empty_magazine(buddyTree, sdTable, threadMagazines->loaded, headerSize, objsPerSlab);
+            flushed += slab_empty_magazine(buddyTree, sdTable, threadMagazines->previous, headerSize, objsPerSlab);
+        }
+    }
+    return flushed;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arena_malloc
+// Description  : allocates memory of given size by bumping the arena's pointer, only
+//                going to the buddy tree when the current chunk is full. arena objects
+//                have no header
+//
+//
+// Inputs       : arena - arena to allocate from
+//              : buddyTree - tree the arena's chunks come from
+//              : size - number of bytes the user asked for
+// Outputs      : pointer to the start of the user's usable memory
+//              : NULL if the arena needed a new chunk and there was no hole for it
+
+static inline void* arena_malloc(ARENA* arena, BUDDYTREE* buddyTree, size_t size){
+    if (size > buddyTree->totalMemSize){
+        return NULL;
+    }
+
+    // keep the bump pointer aligned for the next object. an empty request still takes a
+    // slot, so that it gets a pointer of its own inside the chunk
+    size = (size + ARENA_ALIGNMENT - 1) & ~((size_t)ARENA_ALIGNMENT - 1);
+    if (size == 0){
+        size = ARENA_ALIGNMENT;
+    }
+
+    if ((size_t)(arena->bumpEnd - arena->bumpPtr) >= size){
+        void* memAddr = arena->bumpPtr;
+        arena->bumpPtr += size;
+        return memAddr;
+    }
+
+    return arena_add_chunk(arena, buddyTree, size);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Macro        : MY_ALLOCATOR_DEFINE
+// Description  : defines an allocator whose policy and geometry are fixed at compile
+//                time. MY_ALLOCATOR_DEFINE(node_pool, MALLOC_SLAB, 8, 512, 64) gives
+//                node_pool_setup(), node_pool_malloc() and node_pool_free(), with no
+//                policy switch and with every size computation folded to constants.
+//
+//
+// Inputs       : name - prefix of the generated functions
+//              : type - enum malloc_type policy of the allocator, MALLOC_BUDDY or MALLOC_SLAB
+//              : headerSize - number of header bytes in front of each chunk
+//              : minChunkSize - smallest chunk the buddy tree hands out (a power of two)
+//              : objsPerSlab - number of objects in each slab
+
+#define MY_ALLOCATOR_DEFINE(name, type, headerSize, minChunkSize, objsPerSlab)                      \
+    _Static_assert(((type) == MALLOC_BUDDY) || ((type) == MALLOC_SLAB), #name ": type must be MALLOC_BUDDY or MALLOC_SLAB"); \
+    _Static_assert(((minChunkSize) & ((minChunkSize) - 1)) == 0, #name ": minChunkSize must be a power of two"); \
+    _Static_assert((headerSize) >= (int)sizeof(uint64_t), #name ": headerSize must fit the size header");      \
+                                                                                                     \
+    static BUDDYTREE* name##_buddyTree;                                                              \
+    static SDTABLE* name##_sdTable;                                                                  \
+                                                                                                     \
+    static inline void name##_setup(size_t mem_size, void *start_of_memory){                        \
+        name##_buddyTree = init_buddy_tree(mem_size, start_of_memory);                               \
+        name##_sdTable = init_sd_table();                                                            \
+    }                                                                                                \
+                                                                                                     \
+    static inline void* name##_malloc(size_t size){                                                  \
+        if ((type) == MALLOC_SLAB){                                                                  \
+            return slab_malloc(name##_buddyTree, name##_sdTable, size, (headerSize), (minChunkSize), (objsPerSlab)); \
+        }                                                                                            \
+        return buddy_malloc(name##_buddyTree, size, LIFETIME_DEFAULT, (headerSize), (minChunkSize)); \
+    }                                                                                                \
+                                                                                                     \
+    static inline void name##_free(void *ptr){                                                       \
+        if ((type) == MALLOC_SLAB){                                                                  \
+            slab_free(name##_buddyTree, name##_sdTable, ptr, (headerSize), (objsPerSlab));           \
+            return;                                                                                  \
+        }                                                                                            \
+        buddy_free(name##_buddyTree, ptr, (headerSize));                                             \
+    }
+
+#endif
@@ -1,4 +1,7 @@
+// for pthread_getattr_np()
+#define _GNU_SOURCE
 #include "my_memory.h"
+#include <math.h>
 
 // Memory allocator implementation
 // Implement all other functions here...
@@ -14,7 +17,10 @@
 //              : startOfMemory - void pointer of the start of the memory the tree is meant to manage
 // Outputs      : BUDDYTREE instance that is created from the parameters
 
-BUDDYTREE* init_buddy_tree(int memSize, void *startOfMemory){
+BUDDYTREE* init_buddy_tree(size_t memSize, void *startOfMemory){
+    // make sure size to order lookups are ready before the first allocation
+    init_order_table();
+
     // initialize a root node as a hole of (memSize) size
     TREENODE* rootNode = malloc(sizeof(TREENODE));
     rootNode->isHole = true;
@@ -24,11 +30,24 @@ BUDDYTREE* init_buddy_tree(int memSize, void *startOfMemory){
     rootNode->parent = NULL;
     rootNode->left = NULL;
     rootNode->right = NULL;
+    rootNode->idleSince = 0;
+    rootNode->released = false;
 
     // initialize the buddy system tree
     BUDDYTREE* buddySystemTree = malloc(sizeof(BUDDYTREE));
     buddySystemTree->root = rootNode;
     buddySystemTree->totalMemSize = memSize;
+    buddySystemTree->lazyCoalesce = false;
+    buddySystemTree->deferredMerges = 0;
+    buddySystemTree->mergeWatermark = 0;
+    buddySystemTree->orderTable = NULL;
+    buddySystemTree->orderTableShift = 0;
+    buddySystemTree->touchedPages = NULL;
+    buddySystemTree->opCount = 0;
+    buddySystemTree->decayIdleOps = 0;
+    buddySystemTree->decayLazyFree = false;
+    buddySystemTree->regionClasses = NULL;
+    buddySystemTree->regionSize = 0;
 
     // return the tree
     return buddySystemTree;
@@ -45,12 +64,123 @@ BUDDYTREE* init_buddy_tree(int memSize, void *startOfMemory){
 // Outputs      : SDTABLE instance
 
 SDTABLE* init_sd_table() {
+    static unsigned long nextTableId = 1;
+
     SDTABLE* sdTable = malloc(sizeof(SDTABLE));
     sdTable->headEntry = NULL;
+    sdTable->magazines = false;
+    sdTable->emptyMagazines = NULL;
+    sdTable->id = __atomic_fetch_add(&nextTableId, 1, __ATOMIC_RELAXED);
+    sdTable->depotLock = NULL;
+    sdTable->threadMagazines = NULL;
+    sdTable->slabIndex = NULL;
+    sdTable->slabBase = NULL;
+    sdTable->slabIndexShift = 0;
+    sdTable->slabIndexLength = 0;
     return sdTable;
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : destroy_tree_nodes
+// Description  : frees the given node and every node below it
+//                  
+//
+// Inputs       : node - TREENODE instance of the subtree to free
+// Outputs      : None
+
+static void destroy_tree_nodes(TREENODE* node){
+    if (node == NULL){
+        return;
+    }
+    destroy_tree_nodes(node->left);
+    destroy_tree_nodes(node->right);
+    free(node);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : destroy_buddy_tree
+// Description  : frees every node of a buddy system tree and the tree itself, the
+//                memory the tree managed is left untouched
+//                  
+//
+// Inputs       : buddyTree - tree to free
+// Outputs      : None
+
+void destroy_buddy_tree(BUDDYTREE* buddyTree){
+    destroy_tree_nodes(buddyTree->root);
+    free(buddyTree->orderTable);
+    free(buddyTree->touchedPages);
+    free(buddyTree->regionClasses);
+    free(buddyTree);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_magazines
+// Description  : frees a list of magazines
+//                  
+//
+// Inputs       : magazine - the head of the list
+// Outputs      : None
+
+static void free_magazines(MAGAZINE* magazine){
+    while (magazine != NULL){
+        MAGAZINE* nextMagazine = magazine->next;
+        free(magazine);
+        magazine = nextMagazine;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : destroy_sd_table
+// Description  : frees every entry of a slab descriptor table, their slabs' bookkeeping
+//                and the table itself
+//                  
+//
+// Inputs       : sdTable - an instance of a slab descriptor table
+// Outputs      : None
+
+void destroy_sd_table(SDTABLE* sdTable){
+    SDENTRY* entry = sdTable->headEntry;
+    while (entry != NULL){
+        SDENTRY* nextEntry = entry->nextEntry;
+
+        SLABPTR* slab = entry->slabPtr;
+        while (slab != NULL){
+            SLABPTR* nextSlab = slab->next;
+            free(slab->slabBitMap);
+            free(slab);
+            slab = nextSlab;
+        }
+
+        free_magazines(detach_magazines(entry));
+        free(entry);
+        entry = nextEntry;
+    }
+
+    THREADMAGS* magazines = sdTable->threadMagazines;
+    while (magazines != NULL){
+        THREADMAGS* nextMagazines = magazines->next;
+        free(magazines->loaded);
+        free(magazines->previous);
+        free(magazines);
+        magazines = nextMagazines;
+    }
+    free_magazines(sdTable->emptyMagazines);
+    if (sdTable->slabIndex != NULL){
+        munmap(sdTable->slabIndex, sdTable->slabIndexLength * sizeof(SLABPTR*));
+    }
+    free(sdTable);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : init_sd_entry
@@ -59,24 +189,27 @@ SDTABLE* init_sd_table() {
 //
 // Inputs       : newSlabStartAddr - start address of the slab for the new slab entry
 //              : type - the key that is used for lookups in the SDT "type" represents size of each chunk of memory in a slab
+//              : objsPerSlab - number of objects each slab of this entry holds
 // Outputs      : SDENTRY instance
 
-SDENTRY* init_sd_entry(void* newSlabStartAddr, int type) {
+SDENTRY* init_sd_entry(void* newSlabStartAddr, size_t type, int objsPerSlab) {
     unsigned int* bitMap; // initializes array of ints repr. each slot in slab init. to 0
-    bitMap = calloc(N_OBJS_PER_SLAB, sizeof(unsigned int));
+    bitMap = calloc(objsPerSlab, sizeof(unsigned int));
 
     SLABPTR* slabPtr = malloc(sizeof(SLABPTR));
     slabPtr->slabStartAddr = newSlabStartAddr;
     slabPtr->slabBitMap = bitMap;
+    slabPtr->type = type;
     slabPtr->next = NULL;
     
     SDENTRY* sdEntry = malloc(sizeof(SDENTRY));
     sdEntry->type = type;
-    sdEntry->objTotal = N_OBJS_PER_SLAB;
+    sdEntry->objTotal = objsPerSlab;
     sdEntry->objUsed = 0;
-    sdEntry->size = type * N_OBJS_PER_SLAB;
+    sdEntry->size = type * objsPerSlab;
     sdEntry->slabPtr = slabPtr;
     sdEntry->nextEntry = NULL;
+    sdEntry->fullMagazines = NULL;
 
     return sdEntry;
 }
@@ -92,7 +225,7 @@ SDENTRY* init_sd_entry(void* newSlabStartAddr, int type) {
 //              : type - the type of entry that we are looking for
 // Outputs      : SDENTRY instance matching given type
 
-SDENTRY* sd_table_search(SDTABLE* sdTable, int type) {
+SDENTRY* sd_table_search(SDTABLE* sdTable, size_t type) {
     SDENTRY* travPointer = sdTable->headEntry;
 
     // if the table is empty
@@ -149,6 +282,15 @@ void sd_table_insert(SDTABLE* sdTable, SDENTRY* entry) {
 // Outputs      : None
 
 void sd_table_delete(SDTABLE* sdTable, SDENTRY* entry) {
+    // an entry with no slabs left has no objects in its magazines, keep them for other types
+    MAGAZINE* magazine = detach_magazines(entry);
+    while (magazine != NULL) {
+        MAGAZINE* nextMagazine = magazine->next;
+        magazine->next = sdTable->emptyMagazines;
+        sdTable->emptyMagazines = magazine;
+        magazine = nextMagazine;
+    }
+
     if(sdTable->headEntry == entry) {
         sdTable->headEntry = sdTable->headEntry->nextEntry;
         free(entry);
@@ -172,25 +314,27 @@ void sd_table_delete(SDTABLE* sdTable, SDENTRY* entry) {
 //                  
 //
 // Inputs       : entry - an instacne of SDENTRY
+//              : headerSize - size of the slab header and of each object's header
 // Outputs      : returns a pointer to the allocated address
 //              : NULL if there was no open spots in the slabs inside the given slab entry
 
-void* add_new_memory_to_slab(SDENTRY* entry) {
+void* add_new_memory_to_slab(SDENTRY* entry, int headerSize) {
     void* openSlabAddr = NULL;
     SLABPTR* currentSlabPtr = entry->slabPtr;
     // looping over all the allocated slabPtr's (eg. all the slabs of a given entry)
     while(currentSlabPtr != NULL) {
         // looping over the integers in a specific slabPtr's bitmap
-        for(int i=0; i < N_OBJS_PER_SLAB; i++) {
-            // if an element in bitmap is 0, we have an open space
-            if(currentSlabPtr->slabBitMap[i] == 0) {
+        for(size_t i=0; i < entry->objTotal; i++) {
+            // if an element in bitmap is 0, we have an open space. threads using magazines
+            // change used entries without the lock, so entries are read atomically
+            if(__atomic_load_n(&currentSlabPtr->slabBitMap[i], __ATOMIC_RELAXED) == 0) {
                 // flip the bit because it will now be used
                 currentSlabPtr->slabBitMap[i] = 1;
                 // must calculate address differently if its the first in array
                 if(i == 0) {
-                    return currentSlabPtr->slabStartAddr + 2 * HEADER_SIZE;
+                    return currentSlabPtr->slabStartAddr + 2 * headerSize;
                 } else {
-                    return currentSlabPtr->slabStartAddr + 2 * HEADER_SIZE + (i * entry->type);
+                    return currentSlabPtr->slabStartAddr + 2 * headerSize + (i * entry->type);
                 }
             }
         }
@@ -210,13 +354,27 @@ void* add_new_memory_to_slab(SDENTRY* entry) {
 //
 // Inputs       : startMemBlockAddr - the start address to a block of memory
 //              : size - the size of the memory block to be stored in the header
+//              : headerSize - number of header bytes in front of the memory block
 // Outputs      : None
 
-void put_size_in_header(void* startMemBlockAddr, int size) {
+#ifdef MY_HARDENED
+// the canary of the block at the given address, in the top bits of its header
+static uint64_t header_canary(void* startMemBlockAddr) {
+    uintptr_t addr = (uintptr_t)startMemBlockAddr;
+    return (uint64_t)(uint16_t)(HEADER_CANARY ^ addr ^ (addr >> 16)) << HEADER_SIZE_BITS;
+}
+#endif
+
+void put_size_in_header(void* startMemBlockAddr, size_t size, int headerSize) {
     // Use pointer arithmetic to traverse to the start of the the header
-    void* headerStart = (char*)startMemBlockAddr - HEADER_SIZE;
-    // Store the size of the memBLock in the first 4 bytes of the header
-    *(int*)headerStart = size;
+    void* headerStart = (char*)startMemBlockAddr - headerSize;
+    // Store the size of the memBLock in the first 8 bytes of the header
+#ifdef MY_HARDENED
+    // with the canary above it
+    *(uint64_t*)headerStart = size | header_canary(startMemBlockAddr);
+#else
+    *(uint64_t*)headerStart = size;
+#endif
 }
 
 
@@ -227,12 +385,56 @@ void put_size_in_header(void* startMemBlockAddr, int size) {
 //                  
 //
 // Inputs       : startMemBlockAddr - the start address of requested memory block
+//              : headerSize - number of header bytes in front of the memory block
 // Outputs      : returns an integer value of the size of the memory block
 
-int get_size_in_header(void* startMemBlockAddr) {
+size_t get_size_in_header(void* startMemBlockAddr, int headerSize) {
     // Use pointer arithmetic to traverse to the start of the header
-    void* headerStart = (char*)startMemBlockAddr - HEADER_SIZE;
-    return *(int*)headerStart;
+    void* headerStart = (char*)startMemBlockAddr - headerSize;
+#ifdef MY_HARDENED
+    return *(uint64_t*)headerStart & ((1ULL << HEADER_SIZE_BITS) - 1);
+#else
+    return *(uint64_t*)headerStart;
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : header_intact
+// Description  : checks that the canary put_size_in_header left in a block's header is
+//                still there. a header overwritten by an overflow of the block before it,
+//                or a pointer that never came from the allocator, fails the check
+//
+// Inputs       : startMemBlockAddr - the start address of the memory block
+//              : headerSize - number of header bytes in front of the memory block
+// Outputs      : false if the canary is wrong in a hardened build, true otherwise
+
+bool header_intact(void* startMemBlockAddr, int headerSize) {
+#ifdef MY_HARDENED
+    uint64_t header = *(uint64_t*)((char*)startMemBlockAddr - headerSize);
+    return (header & ~((1ULL << HEADER_SIZE_BITS) - 1)) == header_canary(startMemBlockAddr);
+#else
+    (void)startMemBlockAddr;
+    (void)headerSize;
+    return true;
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : report_heap_error
+// Description  : reports a bad free or a corrupted heap and aborts, so the process stops
+//                before the damage spreads
+//
+// Inputs       : message - what went wrong
+//              : ptr - pointer the caller passed in
+// Outputs      : does not return
+
+void report_heap_error(const char* message, void* ptr) {
+    fprintf(stderr, "my_free(): %s (%p)\n", message, ptr);
+    abort();
 }
 
 
@@ -245,16 +447,17 @@ int get_size_in_header(void* startMemBlockAddr) {
 //
 // Inputs       : entry - an entry for the slab descriptor table
 //              : startAddr - the address that the new slab starts at
-// Outputs      : None
+// Outputs      : the new slab
 
-void add_slab_to_entry(SDENTRY* entry, void* startAddr) {
+SLABPTR* add_slab_to_entry(SDENTRY* entry, void* startAddr) {
     SLABPTR* newSlab = malloc(sizeof(SLABPTR));
     SLABPTR* travPointer = entry->slabPtr;
     unsigned int* bitMap;
-    bitMap = calloc(N_OBJS_PER_SLAB, sizeof(unsigned int));
+    bitMap = calloc(entry->objTotal, sizeof(unsigned int));
     newSlab->next = NULL;
     newSlab->slabBitMap = bitMap;
     newSlab->slabStartAddr = startAddr;
+    newSlab->type = entry->type;
 
     // traverse to end of the linked list of slabs
     while(travPointer->next != NULL) {
@@ -262,6 +465,7 @@ void add_slab_to_entry(SDENTRY* entry, void* startAddr) {
     }
 
     travPointer->next = newSlab;
+    return newSlab;
 }
 
 
@@ -279,6 +483,7 @@ void add_slab_to_entry(SDENTRY* entry, void* startAddr) {
 void remove_slab_from_entry(SDENTRY* entry, SLABPTR* slab) {
     if(entry->slabPtr == slab) {
         entry->slabPtr = entry->slabPtr->next;
+        free(slab->slabBitMap);
         free(slab);
         return;
     }
@@ -287,10 +492,134 @@ void remove_slab_from_entry(SDENTRY* entry, SLABPTR* slab) {
         travPointer = travPointer->next;
     }
     travPointer->next = travPointer->next->next;
+    free(slab->slabBitMap);
     free(slab);
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : count_buddy_operation
+// Description  : counts an allocation or free on the tree, and runs a decay pass every
+//                decayIdleOps operations when decay is turned on
+//                  
+//
+// Inputs       : buddyTree - tree the operation is done on
+// Outputs      : None
+
+static void count_buddy_operation(BUDDYTREE* buddyTree){
+    buddyTree->opCount++;
+
+    if ((buddyTree->decayIdleOps > 0) && (buddyTree->opCount % buddyTree->decayIdleOps == 0)){
+        release_idle_holes(buddyTree, buddyTree->root);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : inherit_idle_state
+// Description  : gives a node that is about to become a merged hole the idle state of
+//                its two children. it has been free since the later child became free,
+//                and is only released if both children were
+//                  
+//
+// Inputs       : node - TREENODE instance whose two hole children are being merged
+// Outputs      : None
+
+static void inherit_idle_state(TREENODE* node){
+    node->idleSince = node->left->idleSince;
+    if (node->right->idleSince > node->idleSince){
+        node->idleSince = node->right->idleSince;
+    }
+    node->released = node->left->released && node->right->released;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : segregation_class
+// Description  : returns the class a chunk belongs to under segregated placement, made up
+//                of its size band (below or above SEGREGATION_SMALL_SIZE) and its lifetime
+//                  
+//
+// Inputs       : chunkSize - size of requested chunk
+//              : lifetime - enum lifetime_hint of the chunk
+// Outputs      : class of the chunk, from 0 to SEGREGATION_CLASSES - 1
+
+static int segregation_class(size_t chunkSize, enum lifetime_hint lifetime){
+    int sizeBand = (chunkSize < SEGREGATION_SMALL_SIZE) ? 0 : 1;
+    return sizeBand * 3 + lifetime;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clear_free_region_classes
+// Description  : gives up the class of every region below the given node that is wholly
+//                free again, so the next chunk placed there can claim it for any class
+//                  
+//
+// Inputs       : buddyTree - tree with segregated placement turned on
+//              : node - TREENODE instance of the subtree to look through
+// Outputs      : None
+
+static void clear_free_region_classes(BUDDYTREE* buddyTree, TREENODE* node){
+    // below region size a hole only frees part of its region
+    if (node == NULL || node->isMem || node->size < buddyTree->regionSize){
+        return;
+    }
+
+    if (node->isHole){
+        long firstRegion = (node->startAddr - buddyTree->root->startAddr) / buddyTree->regionSize;
+        memset(buddyTree->regionClasses + firstRegion, -1, node->size / buddyTree->regionSize);
+        return;
+    }
+
+    clear_free_region_classes(buddyTree, node->left);
+    clear_free_region_classes(buddyTree, node->right);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_preferred_placement_node
+// Description  : finds the hole a new chunk should go in. segregated placement looks in
+//                regions of the chunk's class first, TLB-aware placement looks in touched
+//                huge pages first, otherwise it is the smallest leftmost hole
+//                  
+//
+// Inputs       : buddyTree - tree to find the hole in
+//              : chunkSize - size of requested chunk
+//              : lifetime - enum lifetime_hint of the chunk
+// Outputs      : TREENODE instance of the hole to split the chunk from
+//              : NULL if there is no hole big enough
+
+static TREENODE* find_preferred_placement_node(BUDDYTREE* buddyTree, size_t chunkSize, enum lifetime_hint lifetime){
+    // with segregated placement, chunks smaller than a region go into a region holding
+    // chunks of the same class, or else into a region that is entirely free
+    if ((buddyTree->regionClasses != NULL) && (chunkSize < buddyTree->regionSize)){
+        TREENODE* classNode = find_class_placement_node(buddyTree, buddyTree->root, chunkSize, segregation_class(chunkSize, lifetime));
+        if (classNode == NULL){
+            classNode = find_placement_node(buddyTree->root, buddyTree->regionSize);
+        }
+        if (classNode != NULL){
+            return classNode;
+        }
+    }
+
+    // with TLB-aware placement, chunks smaller than a huge page go into pages that are
+    // already touched whenever there is room, so the working set spans fewer huge pages
+    if ((buddyTree->touchedPages != NULL) && (chunkSize < HUGE_PAGE_SIZE)){
+        TREENODE* touchedNode = find_touched_placement_node(buddyTree, buddyTree->root, chunkSize);
+        if (touchedNode != NULL){
+            return touchedNode;
+        }
+    }
+    return find_placement_node(buddyTree->root, chunkSize);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : create_new_memory_node
@@ -299,22 +628,48 @@ void remove_slab_from_entry(SDENTRY* entry, SLABPTR* slab) {
 //
 // Inputs       : buddyTree - tree to make the new node in
 //              : chunkSize - size of requested node
+//              : lifetime - enum lifetime_hint of the chunk, only used by segregated placement
 // Outputs      : TREENODE instance of the new node containing chunkSize memory
 //              : NULL if unsuccessful
 
-TREENODE* create_new_memory_node(BUDDYTREE* buddyTree, int chunkSize){
-    TREENODE* placementNode = find_placement_node(buddyTree->root, chunkSize);
+TREENODE* create_new_memory_node(BUDDYTREE* buddyTree, size_t chunkSize, enum lifetime_hint lifetime){
+    count_buddy_operation(buddyTree);
+
+    TREENODE* placementNode = find_preferred_placement_node(buddyTree, chunkSize, lifetime);
+
+    // with lazy coalescing the hole we need may still be split into unmerged buddies,
+    // so merge everything that was put off and look again before giving up
+    if ((placementNode == NULL) && (buddyTree->deferredMerges > 0)){
+        coalesce_tree(buddyTree);
+        placementNode = find_preferred_placement_node(buddyTree, chunkSize, lifetime);
+    }
 
     if (placementNode == NULL){
         return NULL;
     }
 
+    // a chunk split from a whole free region claims that region for its class
+    if ((buddyTree->regionClasses != NULL) && (chunkSize < buddyTree->regionSize) && (placementNode->size >= buddyTree->regionSize)){
+        long region = (placementNode->startAddr - buddyTree->root->startAddr) / buddyTree->regionSize;
+        buddyTree->regionClasses[region] = segregation_class(chunkSize, lifetime);
+    }
+
     if (placementNode->size > chunkSize){
         placementNode = split_node(placementNode, chunkSize);
     }
 
     placementNode->isHole = false;
     placementNode->isMem = true;
+    placementNode->released = false;
+
+    // remember every huge page the new chunk covers as touched
+    if (buddyTree->touchedPages != NULL){
+        long firstPage = (placementNode->startAddr - buddyTree->root->startAddr) / HUGE_PAGE_SIZE;
+        long lastPage = (placementNode->startAddr + placementNode->size - 1 - buddyTree->root->startAddr) / HUGE_PAGE_SIZE;
+        for (long page = firstPage; page <= lastPage; page++){
+            buddyTree->touchedPages[page] = 1;
+        }
+    }
 
     return placementNode;
 }
@@ -332,7 +687,7 @@ TREENODE* create_new_memory_node(BUDDYTREE* buddyTree, int chunkSize){
 // Outputs      : TREENODE instance of the smallest leftmost hole that is greater than or equal to requested size
 //              : NULL if there is no such node
 
-TREENODE* find_placement_node(TREENODE* node, int chunkSize){
+TREENODE* find_placement_node(TREENODE* node, size_t chunkSize){
     // this shouldnt ever pass, since every node in the tree will always have two children or be a leaf
     if (node == NULL){
         return NULL;
@@ -379,6 +734,108 @@ TREENODE* find_placement_node(TREENODE* node, int chunkSize){
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_touched_placement_node
+// Description  : finds the smallest leftmost hole that is greater than or equal to
+//                requested size and starts in a huge page that is already touched
+//                  
+//
+// Inputs       : buddyTree - tree with TLB-aware placement turned on
+//              : node - TREENODE instance of starting node to find a placement node from
+//              : chunkSize - size of requested hole
+// Outputs      : TREENODE instance of the smallest leftmost such hole
+//              : NULL if there is no such node
+
+TREENODE* find_touched_placement_node(BUDDYTREE* buddyTree, TREENODE* node, size_t chunkSize){
+    if (node == NULL || node->isMem){
+        return NULL;
+    }
+
+    // a hole only counts if the chunk split from its start lands in a touched page
+    if (node->isHole){
+        long page = (node->startAddr - buddyTree->root->startAddr) / HUGE_PAGE_SIZE;
+        if ((node->size >= chunkSize) && buddyTree->touchedPages[page]){
+            return node;
+        }
+        return NULL;
+    }
+
+    // do not go deeper in the tree than the required chunk size
+    if (node->size <= chunkSize){
+        return NULL;
+    }
+
+    TREENODE* leftPlacement = find_touched_placement_node(buddyTree, node->left, chunkSize);
+    TREENODE* rightPlacement = find_touched_placement_node(buddyTree, node->right, chunkSize);
+
+    // in the case where both sides find a placement hole, return the smaller
+    if ((leftPlacement != NULL) && (rightPlacement != NULL)){
+        if (leftPlacement->size <= rightPlacement->size){
+            return leftPlacement;
+        } else {
+            return rightPlacement;
+        }
+    }
+
+    if (leftPlacement != NULL){
+        return leftPlacement;
+    }
+
+    return rightPlacement;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_class_placement_node
+// Description  : finds the smallest leftmost hole that is greater than or equal to
+//                requested size inside a region claimed by the given class. regions that
+//                are entirely free are left for find_placement_node to hand out
+//                  
+//
+// Inputs       : buddyTree - tree with segregated placement turned on
+//              : node - TREENODE instance of starting node, at or above region size
+//              : chunkSize - size of requested hole, smaller than a region
+//              : sizeClass - class the hole's region must be claimed by
+// Outputs      : TREENODE instance of the smallest leftmost such hole
+//              : NULL if there is no such node
+
+TREENODE* find_class_placement_node(BUDDYTREE* buddyTree, TREENODE* node, size_t chunkSize, int sizeClass){
+    // memory and free regions (or bigger holes) are never partly used by a class
+    if (node == NULL || node->isMem || node->isHole){
+        return NULL;
+    }
+
+    // at region level, only search regions claimed by this class
+    if (node->size <= buddyTree->regionSize){
+        long region = (node->startAddr - buddyTree->root->startAddr) / buddyTree->regionSize;
+        if (buddyTree->regionClasses[region] != sizeClass){
+            return NULL;
+        }
+        return find_placement_node(node, chunkSize);
+    }
+
+    TREENODE* leftPlacement = find_class_placement_node(buddyTree, node->left, chunkSize, sizeClass);
+    TREENODE* rightPlacement = find_class_placement_node(buddyTree, node->right, chunkSize, sizeClass);
+
+    // in the case where both sides find a placement hole, return the smaller
+    if ((leftPlacement != NULL) && (rightPlacement != NULL)){
+        if (leftPlacement->size <= rightPlacement->size){
+            return leftPlacement;
+        } else {
+            return rightPlacement;
+        }
+    }
+
+    if (leftPlacement != NULL){
+        return leftPlacement;
+    }
+
+    return rightPlacement;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : split_node
@@ -389,39 +846,42 @@ TREENODE* find_placement_node(TREENODE* node, int chunkSize){
 //              : chunkSize - size of hole wanted
 // Outputs      : TREENODE instance of the hole with size requested
 
-TREENODE* split_node(TREENODE* node, int chunkSize){
-    // if the node is already requested size, return it
-    if (node->size == chunkSize){
-        return node;
+TREENODE* split_node(TREENODE* node, size_t chunkSize){
+    // keep halving the left child until it reaches requested size
+    while (node->size > chunkSize){
+        // initialize left child
+        TREENODE* leftChild = malloc(sizeof(TREENODE));
+        leftChild->isHole = true;
+        leftChild->isMem = false;
+        leftChild->size = (node->size / 2);
+        leftChild->startAddr = node->startAddr;
+        leftChild->parent = node;
+        leftChild->left = NULL;
+        leftChild->right = NULL;
+        leftChild->idleSince = node->idleSince;
+        leftChild->released = node->released;
+
+        // initialize right child
+        TREENODE* rightChild = malloc(sizeof(TREENODE));
+        rightChild->isHole = true;
+        rightChild->isMem = false;
+        rightChild->size = (node->size / 2);
+        rightChild->startAddr = node->startAddr + (node->size / 2);
+        rightChild->parent = node;
+        rightChild->left = NULL;
+        rightChild->right = NULL;
+        rightChild->idleSince = node->idleSince;
+        rightChild->released = node->released;
+
+        // set node's children to initialized nodes, and set itself as no longer a hole
+        node->left = leftChild;
+        node->right = rightChild;
+        node->isHole = false;
+
+        node = leftChild;
     }
 
-    // initialize left child
-    TREENODE* leftChild = malloc(sizeof(TREENODE));
-    leftChild->isHole = true;
-    leftChild->isMem = false;
-    leftChild->size = (node->size / 2);
-    leftChild->startAddr = node->startAddr;
-    leftChild->parent = node;
-    leftChild->left = NULL;
-    leftChild->right = NULL;
-
-    // initialize right child
-    TREENODE* rightChild = malloc(sizeof(TREENODE));
-    rightChild->isHole = true;
-    rightChild->isMem = false;
-    rightChild->size = (node->size / 2);
-    rightChild->startAddr = node->startAddr + (node->size / 2);
-    rightChild->parent = node;
-    rightChild->left = NULL;
-    rightChild->right = NULL;
-
-    // set node's children to initialized nodes, and set itself as no longer a hole
-    node->left = leftChild;
-    node->right = rightChild;
-    node->isHole = false;
-
-    // make the left child split further until it reaches requested size
-    return split_node(node->left, chunkSize);
+    return node;
 }
 
 
@@ -437,30 +897,18 @@ TREENODE* split_node(TREENODE* node, int chunkSize){
 //              : NULL null if there is no such node
 
 TREENODE* find_node_by_address(TREENODE* node, void *ptr){
-    // this shouldnt ever pass, since every node in the tree will always have two children or be a leaf
-    if (node == NULL){
-        return NULL;
-    }
-
-    // a node is a leaf, check if it is the one we are looking for
-    if (node->isHole || node->isMem){
-        if (node->startAddr == ptr){
-            return node;
+    // buddies split their parent in half, so the address alone tells us which child to walk into
+    while ((node != NULL) && !node->isHole && !node->isMem){
+        if (ptr < node->right->startAddr){
+            node = node->left;
         } else {
-            return NULL;
+            node = node->right;
         }
     }
 
-    // look for the node in both children
-    TREENODE* leftRemovalNode = find_node_by_address(node->left, ptr);
-    TREENODE* rightRemovalNode = find_node_by_address(node->right, ptr);
-
-    if (leftRemovalNode != NULL){
-        return leftRemovalNode;
-    }
-
-    if (rightRemovalNode != NULL){
-        return rightRemovalNode;
+    // a node is a leaf, check if it is the one we are looking for
+    if ((node != NULL) && (node->startAddr == ptr)){
+        return node;
     }
 
     // if the node is not found from starting node, return null
@@ -478,31 +926,642 @@ TREENODE* find_node_by_address(TREENODE* node, void *ptr){
 //              : memSize - the memory's total size (also the maximum size a hole can be)
 // Outputs      : none
 
-void check_for_merge(TREENODE* node, int memSize){
-    // if the node contains either a hole or memory, stop trying to merge it
-    if (node->isMem || node->isHole){
+void check_for_merge(TREENODE* node, size_t memSize){
+    // walk up the tree for as long as the merged hole's buddy is also a hole
+    while (node != NULL){
+        // if the node contains either a hole or memory, stop trying to merge it
+        if (node->isMem || node->isHole){
+            return;
+        }
+
+        // only continue with the merge if both children are holes
+        if (!node->left->isHole || !node->right->isHole){
+            return;
+        }
+
+        // the merged hole has been free since its later half became free
+        inherit_idle_state(node);
+
+        // remove children and set itself as a hole
+        free(node->left);
+        node->left = NULL;
+        free(node->right);
+        node->right = NULL;
+        node->isHole = true;
+
+        // if the new hole is size of the total memory, do not merge any more
+        if (node->size == memSize){
+            return;
+        }
+
+        // now that this node is a hole, have the node's parent check if it can merge its children
+        node = node->parent;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_memory_node
+// Description  : turns a memory node back into a hole. with eager coalescing the hole is
+//                merged with its buddies right away, with lazy coalescing the merge is
+//                put off until an allocation fails or the watermark is passed
+//                  
+//
+// Inputs       : buddyTree - tree the node belongs to
+//              : node - TREENODE instance of the memory node being released
+// Outputs      : none
+
+void release_memory_node(BUDDYTREE* buddyTree, TREENODE* node){
+    count_buddy_operation(buddyTree);
+
+    // set the node as a hole
+    node->isMem = false;
+    node->isHole = true;
+    node->idleSince = buddyTree->opCount;
+    node->released = false;
+
+    if (!buddyTree->lazyCoalesce){
+        // merge any holes next to each other in the tree
+        void* startAddr = node->startAddr;
+        check_for_merge(node->parent, buddyTree->totalMemSize);
+
+        // the merged hole holding the freed chunk may have emptied its whole region
+        if (buddyTree->regionClasses != NULL){
+            TREENODE* hole = buddyTree->root;
+            while (!hole->isHole && !hole->isMem){
+                hole = (startAddr < hole->right->startAddr) ? hole->left : hole->right;
+            }
+            clear_free_region_classes(buddyTree, hole);
+        }
+        return;
+    }
+
+    // leave the hole at its own size so a same sized request can reuse it without a split
+    buddyTree->deferredMerges++;
+
+    // too many unmerged holes, coalesce the whole tree
+    if ((buddyTree->mergeWatermark > 0) && (buddyTree->deferredMerges >= buddyTree->mergeWatermark)){
+        coalesce_tree(buddyTree);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : coalesce_holes
+// Description  : merges every pair of buddy holes below the given node, working from the
+//                leaves up so that merged holes can merge again with their own buddies
+//                  
+//
+// Inputs       : node - TREENODE instance of the subtree to coalesce
+// Outputs      : none
+
+void coalesce_holes(TREENODE* node){
+    // leaves have nothing to merge
+    if (node == NULL || node->isHole || node->isMem){
         return;
     }
 
-    // only continue with the merge if both children are holes
+    coalesce_holes(node->left);
+    coalesce_holes(node->right);
+
+    // only merge if both children ended up as holes
     if (!node->left->isHole || !node->right->isHole){
         return;
     }
 
+    inherit_idle_state(node);
+
     // remove children and set itself as a hole
     free(node->left);
     node->left = NULL;
     free(node->right);
     node->right = NULL;
     node->isHole = true;
-
-    // if the new hole is size of the total memory, do not merge any more
-    if (node->size == memSize){
-        return;
-    }
-
-    // now that this node is a hole, make the node's parent check if it can merge its children
-    check_for_merge(node->parent, memSize);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : coalesce_tree
+// Description  : runs the merges lazy coalescing put off over the whole tree, and gives
+//                up the class of every region that is wholly free once they are done
+//                  
+//
+// Inputs       : buddyTree - tree to coalesce
+// Outputs      : none
+
+void coalesce_tree(BUDDYTREE* buddyTree){
+    coalesce_holes(buddyTree->root);
+    buddyTree->deferredMerges = 0;
+
+    if (buddyTree->regionClasses != NULL){
+        clear_free_region_classes(buddyTree, buddyTree->root);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_idle_holes
+// Description  : hands the pages of every hole of at least DECAY_MIN_SIZE that has stayed
+//                free for decayIdleOps operations back to the OS. the hole stays in the
+//                tree, its pages fault back in (zeroed, or as they were with MADV_FREE)
+//                when it is allocated again
+//                  
+//
+// Inputs       : buddyTree - tree with decay turned on
+//              : node - TREENODE instance of the subtree to look through
+// Outputs      : number of bytes handed back to the OS
+
+long release_idle_holes(BUDDYTREE* buddyTree, TREENODE* node){
+    // memory nodes are in use and holes below the minimum are not worth a system call
+    if (node == NULL || node->isMem || node->size < DECAY_MIN_SIZE){
+        return 0;
+    }
+
+    if (!node->isHole){
+        return release_idle_holes(buddyTree, node->left) + release_idle_holes(buddyTree, node->right);
+    }
+
+    if (node->released || (buddyTree->opCount - node->idleSince < (unsigned long)buddyTree->decayIdleOps)){
+        return 0;
+    }
+
+    // only whole pages inside the hole can be released
+    uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t releaseStart = ((uintptr_t)node->startAddr + pageSize - 1) & ~(pageSize - 1);
+    uintptr_t releaseEnd = ((uintptr_t)node->startAddr + node->size) & ~(pageSize - 1);
+    if (releaseEnd <= releaseStart){
+        return 0;
+    }
+
+    int advice = MADV_DONTNEED;
+#ifdef MADV_FREE
+    if (buddyTree->decayLazyFree){
+        advice = MADV_FREE;
+    }
+#endif
+    if (madvise((void*)releaseStart, releaseEnd - releaseStart, advice) != 0){
+        return 0;
+    }
+    node->released = true;
+
+    // huge pages wholly inside the hole are no longer resident, so stop packing into them
+    if (buddyTree->touchedPages != NULL){
+        long offset = node->startAddr - buddyTree->root->startAddr;
+        long firstPage = (offset + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE;
+        long endPage = (offset + node->size) / HUGE_PAGE_SIZE;
+        for (long page = firstPage; page < endPage; page++){
+            buddyTree->touchedPages[page] = 0;
+        }
+    }
+
+    return releaseEnd - releaseStart;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_order_side_table
+// Description  : creates the side table that keeps the order of header-less chunks. every
+//                chunk starts on a multiple of the minimum chunk size, so one byte per
+//                minimum chunk of the tree is enough to key the table by offset
+//                  
+//
+// Inputs       : buddyTree - tree whose chunks the table describes
+//              : minChunkSize - smallest chunk the tree hands out (a power of two)
+// Outputs      : None
+
+void init_order_side_table(BUDDYTREE* buddyTree, int minChunkSize){
+    if (buddyTree->orderTable != NULL){
+        return;
+    }
+    buddyTree->orderTableShift = __builtin_ctz(minChunkSize);
+    buddyTree->orderTable = calloc((buddyTree->totalMemSize >> buddyTree->orderTableShift) + 1, sizeof(unsigned char));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_chunk_order
+// Description  : records the order of the chunk starting at chunkAddr in the side table
+//                  
+//
+// Inputs       : buddyTree - tree the chunk belongs to
+//              : chunkAddr - start address of the chunk
+//              : order - log base 2 of the chunk's size, 0 once the chunk is freed
+// Outputs      : None
+
+void set_chunk_order(BUDDYTREE* buddyTree, void* chunkAddr, int order){
+    long offset = chunkAddr - buddyTree->root->startAddr;
+    buddyTree->orderTable[offset >> buddyTree->orderTableShift] = order;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_chunk_order
+// Description  : returns the order of the chunk starting at chunkAddr from the side table
+//                  
+//
+// Inputs       : buddyTree - tree the chunk belongs to
+//              : chunkAddr - start address of the chunk
+// Outputs      : log base 2 of the chunk's size, 0 if no chunk starts there
+
+int get_chunk_order(BUDDYTREE* buddyTree, void* chunkAddr){
+    long offset = chunkAddr - buddyTree->root->startAddr;
+    return buddyTree->orderTable[offset >> buddyTree->orderTableShift];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_touched_pages
+// Description  : turns on TLB-aware placement for the tree by tracking which huge pages
+//                have had a chunk placed in them
+//                  
+//
+// Inputs       : buddyTree - tree to track huge pages for
+// Outputs      : None
+
+void init_touched_pages(BUDDYTREE* buddyTree){
+    if (buddyTree->touchedPages != NULL){
+        return;
+    }
+    size_t nPages = (buddyTree->totalMemSize + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE;
+    buddyTree->touchedPages = calloc(nPages, sizeof(unsigned char));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_region_classes
+// Description  : turns on segregated placement for the tree. the tree is divided into
+//                regions of SEGREGATION_REGION_SIZE (smaller for small trees so there are
+//                at least SEGREGATION_MIN_REGIONS), each claimed by the class of the first
+//                chunk placed in it while it was free
+//                  
+//
+// Inputs       : buddyTree - tree to segregate
+// Outputs      : None
+
+void init_region_classes(BUDDYTREE* buddyTree){
+    if (buddyTree->regionClasses != NULL){
+        return;
+    }
+
+    size_t regionSize = SEGREGATION_REGION_SIZE;
+    while ((regionSize > 1) && (buddyTree->totalMemSize / regionSize < SEGREGATION_MIN_REGIONS)){
+        regionSize = regionSize / 2;
+    }
+
+    size_t nRegions = buddyTree->totalMemSize / regionSize;
+    buddyTree->regionSize = regionSize;
+    buddyTree->regionClasses = malloc(nRegions * sizeof(signed char));
+    memset(buddyTree->regionClasses, -1, nRegions * sizeof(signed char));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : measure_free_holes
+// Description  : adds up the free memory below the given node and finds the biggest hole
+//                  
+//
+// Inputs       : node - TREENODE instance of the subtree to measure
+//              : totalFree - incremented by the bytes in every hole
+//              : largestFree - raised to the size of the biggest hole
+// Outputs      : None
+
+void measure_free_holes(TREENODE* node, size_t* totalFree, size_t* largestFree){
+    if (node == NULL || node->isMem){
+        return;
+    }
+
+    if (node->isHole){
+        *totalFree += node->size;
+        if (node->size > *largestFree){
+            *largestFree = node->size;
+        }
+        return;
+    }
+
+    measure_free_holes(node->left, totalFree, largestFree);
+    measure_free_holes(node->right, totalFree, largestFree);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : map_region
+// Description  : maps memSize bytes of anonymous memory starting on a huge page boundary.
+//                HUGEPAGE_HUGETLB asks for explicit huge pages and falls back to
+//                HUGEPAGE_MADVISE when none are reserved, HUGEPAGE_MADVISE asks for
+//                transparent huge pages
+//                  
+//
+// Inputs       : memSize - number of bytes needed
+//              : mode - kind of huge page backing wanted
+//              : mappedRegion - set to the start of the whole mapping (for munmap)
+//              : mappedSize - set to the length of the whole mapping (for munmap)
+// Outputs      : huge page aligned start of the memSize bytes
+//              : NULL if the memory could not be mapped
+
+void* map_region(size_t memSize, enum hugepage_mode mode, void** mappedRegion, size_t* mappedSize){
+    size_t length = (memSize + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+
+    // explicit huge pages come back aligned, but only if the system has some reserved
+    if (mode == HUGEPAGE_HUGETLB){
+        void* region = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED){
+            *mappedRegion = region;
+            *mappedSize = length;
+            return region;
+        }
+        mode = HUGEPAGE_MADVISE;
+    }
+
+    // map an extra huge page so the region can start on a huge page boundary. regions can
+    // be far bigger than what is ever touched, so no swap is reserved for them up front
+    size_t padded = length + HUGE_PAGE_SIZE;
+    void* region = mmap(NULL, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED){
+        return NULL;
+    }
+    void* alignedStart = (void*)(((uintptr_t)region + HUGE_PAGE_SIZE - 1) & ~((uintptr_t)HUGE_PAGE_SIZE - 1));
+
+    // transparent huge pages are only a hint, the region still works without them
+    if (mode == HUGEPAGE_MADVISE){
+        madvise(alignedStart, length, MADV_HUGEPAGE);
+    }
+
+    *mappedRegion = region;
+    *mappedSize = padded;
+    return alignedStart;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : numa_node_count
+// Description  : returns the number of NUMA nodes on the machine, read from the ranges
+//                in /sys/devices/system/node/online (eg. "0-1")
+//                  
+//
+// Inputs       : None
+// Outputs      : number of NUMA nodes, 1 if it cannot be found out
+
+int numa_node_count(){
+    FILE* onlineFile = fopen("/sys/devices/system/node/online", "r");
+    if (onlineFile == NULL){
+        return 1;
+    }
+
+    // the highest node listed in any range decides the count
+    int highestNode = 0;
+    int first, last;
+    int matched;
+    while ((matched = fscanf(onlineFile, "%d-%d", &first, &last)) >= 1){
+        if (matched == 1){
+            last = first;
+        }
+        if (last > highestNode){
+            highestNode = last;
+        }
+        // skip the comma between ranges
+        if (fgetc(onlineFile) != ','){
+            break;
+        }
+    }
+    fclose(onlineFile);
+
+    if (highestNode + 1 > MAX_NUMA_NODES){
+        return MAX_NUMA_NODES;
+    }
+    return highestNode + 1;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : current_numa_node
+// Description  : returns the NUMA node the calling thread is running on, using the
+//                getcpu system call
+//                  
+//
+// Inputs       : None
+// Outputs      : NUMA node of the caller, 0 if it cannot be found out
+
+int current_numa_node(){
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0){
+        return 0;
+    }
+    return node;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bind_to_numa_node
+// Description  : binds the whole pages inside the given memory to a NUMA node with the
+//                mbind system call, pages already touched elsewhere are moved. binding
+//                is only a placement hint, so failures are ignored
+//                  
+//
+// Inputs       : startAddr - start of the memory to bind
+//              : size - number of bytes to bind
+//              : node - NUMA node to bind the memory to
+// Outputs      : None
+
+// mbind policy and flags from linux/mempolicy.h
+#define MPOL_BIND_POLICY 2
+#define MPOL_MF_MOVE_FLAG (1 << 1)
+
+void bind_to_numa_node(void* startAddr, size_t size, int node){
+    uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t bindStart = ((uintptr_t)startAddr + pageSize - 1) & ~(pageSize - 1);
+    uintptr_t bindEnd = ((uintptr_t)startAddr + size) & ~(pageSize - 1);
+    if (bindEnd <= bindStart){
+        return;
+    }
+
+    unsigned long nodeMask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+    nodeMask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+    syscall(SYS_mbind, bindStart, bindEnd - bindStart, MPOL_BIND_POLICY, nodeMask, MAX_NUMA_NODES + 1, MPOL_MF_MOVE_FLAG);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_arena
+// Description  : initializes an arena with no chunks, the first allocation gets one
+//                  
+//
+// Inputs       : None
+// Outputs      : ARENA instance
+
+ARENA* init_arena(){
+    ARENA* arena = malloc(sizeof(ARENA));
+    arena->current = NULL;
+    arena->bumpPtr = NULL;
+    arena->bumpEnd = NULL;
+    return arena;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arena_add_chunk
+// Description  : gets a new chunk for the arena from the buddy tree (a bigger one if the
+//                request does not fit in ARENA_CHUNK_SIZE) and allocates size bytes from it
+//                  
+//
+// Inputs       : arena - arena that ran out of room in its current chunk
+//              : buddyTree - tree to get the chunk from
+//              : size - number of bytes to allocate, already rounded to ARENA_ALIGNMENT
+// Outputs      : pointer to the allocated bytes
+//              : NULL if the tree has no hole for the chunk
+
+void* arena_add_chunk(ARENA* arena, BUDDYTREE* buddyTree, size_t size){
+    // arena memory is all released together, so keep it apart from longer lived chunks
+    TREENODE* chunkNode = create_new_memory_node(buddyTree, next_power_of_two(size, ARENA_CHUNK_SIZE), LIFETIME_SHORT);
+
+    if (chunkNode == NULL){
+        return NULL;
+    }
+
+    // the new chunk goes on the front of the list and becomes the one being filled
+    ARENACHUNK* chunk = malloc(sizeof(ARENACHUNK));
+    chunk->node = chunkNode;
+    chunk->prev = arena->current;
+    arena->current = chunk;
+
+    arena->bumpPtr = chunkNode->startAddr + size;
+    arena->bumpEnd = chunkNode->startAddr + chunkNode->size;
+    return chunkNode->startAddr;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arena_rewind
+// Description  : gives every chunk newer than the given one back to the buddy tree and
+//                moves the bump pointer back to position, a NULL chunk empties the arena.
+//                a mark whose chunk was already given back, or whose position is past the
+//                bump pointer of the chunk being filled, is stale and is ignored
+//                  
+//
+// Inputs       : arena - arena to rewind
+//              : buddyTree - tree the arena's chunks came from
+//              : profiler - profiler whose samples of the released memory are dropped (or NULL)
+//              : chunk - chunk that was being filled when the mark was taken
+//              : position - bump pointer when the mark was taken
+// Outputs      : None
+
+void arena_rewind(ARENA* arena, BUDDYTREE* buddyTree, PROFILER* profiler, ARENACHUNK* chunk, void* position){
+    if (chunk != NULL){
+        ARENACHUNK* travChunk = arena->current;
+        while ((travChunk != NULL) && (travChunk != chunk)){
+            travChunk = travChunk->prev;
+        }
+        FREE_CHECK(travChunk != NULL, "stale arena mark", position);
+        void* fillEnd = (chunk == arena->current) ? arena->bumpPtr : chunk->node->startAddr + chunk->node->size;
+        FREE_CHECK((position >= chunk->node->startAddr) && (position <= fillEnd), "stale arena mark", position);
+    }
+
+    // release chunks from the newest back to the marked one
+    while (arena->current != chunk){
+        ARENACHUNK* released = arena->current;
+        arena->current = released->prev;
+        if (profiler != NULL){
+            forget_samples_between(profiler, released->node->startAddr, released->node->startAddr + released->node->size);
+        }
+        release_memory_node(buddyTree, released->node);
+        free(released);
+    }
+
+    if (chunk == NULL){
+        arena->bumpPtr = NULL;
+        arena->bumpEnd = NULL;
+        return;
+    }
+
+    if (profiler != NULL){
+        forget_samples_between(profiler, position, chunk->node->startAddr + chunk->node->size);
+    }
+    arena->bumpPtr = position;
+    arena->bumpEnd = chunk->node->startAddr + chunk->node->size;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : destroy_arena
+// Description  : frees the arena's bookkeeping, the chunk nodes are freed with the tree
+//                  
+//
+// Inputs       : arena - arena to free
+// Outputs      : None
+
+void destroy_arena(ARENA* arena){
+    while (arena->current != NULL){
+        ARENACHUNK* prev = arena->current->prev;
+        free(arena->current);
+        arena->current = prev;
+    }
+    free(arena);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_order_table
+// Description  : fills in the lookup table of orders for small sizes, only does the
+//                work the first time it is called
+//                  
+//
+// Inputs       : None
+// Outputs      : None
+
+static unsigned char smallSizeOrders[SMALL_ORDER_TABLE_SIZE + 1];
+static bool smallSizeOrdersReady = false;
+
+void init_order_table(){
+    if (smallSizeOrdersReady){
+        return;
+    }
+
+    // a size of 0 or 1 fits in a block of order 0
+    smallSizeOrders[0] = 0;
+    smallSizeOrders[1] = 0;
+    for (int size = 2; size <= SMALL_ORDER_TABLE_SIZE; size++){
+        smallSizeOrders[size] = 32 - __builtin_clz(size - 1);
+    }
+
+    smallSizeOrdersReady = true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : size_to_order
+// Description  : returns the order (log base 2) of the smallest power of two that is
+//                greater than or equal to given number
+//                  
+//
+// Inputs       : size - number of bytes
+// Outputs      : integer value of the order that fits size
+
+int size_to_order(size_t size){
+    // small sizes are looked up, everything else is one count leading zeros
+    if (size <= SMALL_ORDER_TABLE_SIZE){
+        return smallSizeOrders[size];
+    }
+    return 64 - __builtin_clzl(size - 1);
 }
 
 
@@ -512,13 +1571,1321 @@ void check_for_merge(TREENODE* node, int memSize){
 // Description  : returns a power of two greater than or equal to given number
 //                  
 //
-// Inputs       : num - integer value
-// Outputs      : integer value of a power of two greater than or equal to num
+// Inputs       : num - number of bytes, at most half the address space
+//              : minChunkSize - smallest power of two that may be returned
+// Outputs      : a power of two greater than or equal to num
+
+size_t next_power_of_two(size_t num, size_t minChunkSize){
+    int order = size_to_order(num);
+    if (order < __builtin_ctzl(minChunkSize)){
+        order = __builtin_ctzl(minChunkSize);
+    }
+    return (size_t)1 << order;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_empty_magazine
+// Description  : takes an empty magazine from the depot, or makes one if there is none
+//                  
+//
+// Inputs       : sdTable - table whose depot to use
+// Outputs      : an empty magazine
+
+static MAGAZINE* get_empty_magazine(SDTABLE* sdTable){
+    MAGAZINE* magazine = sdTable->emptyMagazines;
+    if (magazine != NULL){
+        sdTable->emptyMagazines = magazine->next;
+    } else {
+        magazine = malloc(sizeof(MAGAZINE));
+    }
+    magazine->rounds = 0;
+    magazine->next = NULL;
+    return magazine;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lock_depot / unlock_depot
+// Description  : takes or releases the lock guarding the table's depots, its entries and
+//                its list of thread magazines, when the heap has one
+//
+// Inputs       : sdTable - table whose depots to lock or unlock
+// Outputs      : None
+
+static void lock_depot(SDTABLE* sdTable){
+    if (sdTable->depotLock != NULL){
+        pthread_mutex_lock(sdTable->depotLock);
+    }
+}
 
-int next_power_of_two(int num){
-    int result = MIN_MEM_CHUNK_SIZE;
-    while(num > result){
-        result = result * 2;
+static void unlock_depot(SDTABLE* sdTable){
+    if (sdTable->depotLock != NULL){
+        pthread_mutex_unlock(sdTable->depotLock);
     }
-    return result;
+}
+
+
+// The thread's magazines it used last, keyed by table id and object type. a slot of a
+// destroyed table is never matched again, since table ids are not reused
+static __thread struct {
+    unsigned long tableId;
+    size_t type;
+    THREADMAGS* magazines;
+} threadMagazineSlots[THREAD_MAGAZINE_SLOTS];
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : thread_magazines
+// Description  : finds the calling thread's magazines for objects of given type, making
+//                them the first time. only a thread's first use of a type, or of one
+//                whose slot was taken over, takes the lock
+//
+// Inputs       : sdTable - table the objects belong to
+//              : type - size of each object, header included
+// Outputs      : the thread's magazines of that type
+
+static THREADMAGS* thread_magazines(SDTABLE* sdTable, size_t type){
+    unsigned long hash = (type ^ (sdTable->id << 32)) * 0x9E3779B97F4A7C15UL;
+    int slot = (hash >> 32) % THREAD_MAGAZINE_SLOTS;
+    if ((threadMagazineSlots[slot].tableId == sdTable->id) && (threadMagazineSlots[slot].type == type)){
+        return threadMagazineSlots[slot].magazines;
+    }
+
+    pthread_t self = pthread_self();
+    lock_depot(sdTable);
+    THREADMAGS* magazines = sdTable->threadMagazines;
+    while ((magazines != NULL) && ((magazines->type != type) || !pthread_equal(magazines->owner, self))){
+        magazines = magazines->next;
+    }
+    if (magazines == NULL){
+        magazines = malloc(sizeof(THREADMAGS));
+        magazines->owner = self;
+        magazines->type = type;
+        magazines->loaded = get_empty_magazine(sdTable);
+        magazines->previous = get_empty_magazine(sdTable);
+        magazines->next = sdTable->threadMagazines;
+        sdTable->threadMagazines = magazines;
+    }
+    unlock_depot(sdTable);
+
+    threadMagazineSlots[slot].tableId = sdTable->id;
+    threadMagazineSlots[slot].type = type;
+    threadMagazineSlots[slot].magazines = magazines;
+    return magazines;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : magazine_alloc
+// Description  : takes an object from the thread's loaded magazine of its type. when it
+//                is empty it is swapped with the previous magazine, or traded with the
+//                depot for a full one, and only when the depot has none either is it
+//                refilled from the slabs' bitmaps, MAGAZINE_SIZE objects in one pass.
+//                only the trade and the refill take the depot's lock
+//
+// Inputs       : sdTable - table holding the depots and the slabs
+//              : size - number of bytes the user asked for
+//              : headerSize - number of header bytes in front of each object
+// Outputs      : pointer to the start of the user's usable memory
+//              : NULL if the slabs of that size are full too, or there are none
+
+void* magazine_alloc(SDTABLE* sdTable, size_t size, int headerSize){
+    // a size this close to SIZE_MAX has no slab
+    if (size > SIZE_MAX - headerSize){
+        return NULL;
+    }
+    size_t type = headerSize + size;
+    THREADMAGS* magazines = thread_magazines(sdTable, type);
+
+    if (magazines->loaded->rounds == 0){
+        if (magazines->previous->rounds > 0){
+            MAGAZINE* magazine = magazines->loaded;
+            magazines->loaded = magazines->previous;
+            magazines->previous = magazine;
+        } else {
+            lock_depot(sdTable);
+            SDENTRY* entry = sd_table_search(sdTable, type);
+            if ((entry != NULL) && (entry->fullMagazines != NULL)){
+                // the empty previous magazine goes to the depot, loaded takes its place
+                magazines->previous->next = sdTable->emptyMagazines;
+                sdTable->emptyMagazines = magazines->previous;
+                magazines->previous = magazines->loaded;
+                magazines->loaded = entry->fullMagazines;
+                entry->fullMagazines = magazines->loaded->next;
+                magazines->loaded->next = NULL;
+            } else if (entry != NULL){
+                MAGAZINE* magazine = magazines->loaded;
+                for (SLABPTR* slab = entry->slabPtr; (slab != NULL) && (magazine->rounds < MAGAZINE_SIZE); slab = slab->next){
+                    for (size_t i = 0; (i < entry->objTotal) && (magazine->rounds < MAGAZINE_SIZE); i++){
+                        if (__atomic_load_n(&slab->slabBitMap[i], __ATOMIC_RELAXED) != 0){
+                            continue;
+                        }
+                        void* memAddr = slab->slabStartAddr + 2 * headerSize + (i * entry->type);
+                        slab->slabBitMap[i] = SLAB_OBJ_CACHED;
+                        put_size_in_header(memAddr, size, headerSize);
+                        magazine->objs[magazine->rounds] = memAddr;
+                        magazine->marks[magazine->rounds++] = &slab->slabBitMap[i];
+                    }
+                }
+
+                // hand the objects out lowest address first, as the slabs would
+                for (int i = 0; i < magazine->rounds / 2; i++){
+                    void* obj = magazine->objs[i];
+                    unsigned int* mark = magazine->marks[i];
+                    magazine->objs[i] = magazine->objs[magazine->rounds - 1 - i];
+                    magazine->marks[i] = magazine->marks[magazine->rounds - 1 - i];
+                    magazine->objs[magazine->rounds - 1 - i] = obj;
+                    magazine->marks[magazine->rounds - 1 - i] = mark;
+                }
+            }
+            unlock_depot(sdTable);
+
+            if (magazines->loaded->rounds == 0){
+                return NULL;
+            }
+        }
+    }
+
+    // the lock holders only ever ask whether a bitmap entry is 0, which this never changes
+    MAGAZINE* magazine = magazines->loaded;
+    magazine->rounds--;
+    __atomic_store_n(magazine->marks[magazine->rounds], 1, __ATOMIC_RELAXED);
+    return magazine->objs[magazine->rounds];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : magazine_free
+// Description  : puts a freed object in the thread's loaded magazine of its type. when
+//                it is full it is swapped with the previous magazine if that one is
+//                empty, otherwise the previous magazine goes to the depot, taking the
+//                depot's lock, and loaded starts an empty one
+//
+// Inputs       : sdTable - table holding the depots and the slabs
+//              : type - size of each object of the object's slab
+//              : ptr - object being freed
+//              : mark - the object's bitmap entry, already set to SLAB_OBJ_CACHED
+// Outputs      : None
+
+void magazine_free(SDTABLE* sdTable, size_t type, void* ptr, unsigned int* mark){
+    THREADMAGS* magazines = thread_magazines(sdTable, type);
+
+    if (magazines->loaded->rounds == MAGAZINE_SIZE){
+        if (magazines->previous->rounds == 0){
+            MAGAZINE* magazine = magazines->loaded;
+            magazines->loaded = magazines->previous;
+            magazines->previous = magazine;
+        } else {
+            // the object being freed keeps its slab, and so its entry, around
+            lock_depot(sdTable);
+            SDENTRY* entry = sd_table_search(sdTable, type);
+            magazines->previous->next = entry->fullMagazines;
+            entry->fullMagazines = magazines->previous;
+            magazines->previous = magazines->loaded;
+            magazines->loaded = get_empty_magazine(sdTable);
+            unlock_depot(sdTable);
+        }
+    }
+
+    magazines->loaded->objs[magazines->loaded->rounds] = ptr;
+    magazines->loaded->marks[magazines->loaded->rounds++] = mark;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : detach_magazines
+// Description  : takes the depot of full magazines off an entry
+//                  
+//
+// Inputs       : entry - slab descriptor entry
+// Outputs      : the entry's full magazines as one list (NULL if it had none)
+
+MAGAZINE* detach_magazines(SDENTRY* entry){
+    MAGAZINE* magazines = entry->fullMagazines;
+    entry->fullMagazines = NULL;
+    return magazines;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : index_slabs
+// Description  : maps an index of the slab starting at each chunk of the tree and
+//                records the table's slabs in it, if it has no index yet. the index is
+//                only paged in where slabs are, and is kept up to date from then on
+//
+// Inputs       : sdTable - table whose slabs to index
+//              : buddyTree - tree the slabs are allocated from
+//              : minChunkSize - smallest chunk the tree hands out
+// Outputs      : true if the table has an index
+//              : false if it could not be mapped
+
+bool index_slabs(SDTABLE* sdTable, BUDDYTREE* buddyTree, int minChunkSize){
+    if (sdTable->slabIndex != NULL){
+        return true;
+    }
+
+    size_t indexLength = buddyTree->totalMemSize / minChunkSize;
+    SLABPTR** slabIndex = mmap(NULL, indexLength * sizeof(SLABPTR*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slabIndex == MAP_FAILED){
+        return false;
+    }
+    sdTable->slabIndex = slabIndex;
+    sdTable->slabBase = buddyTree->root->startAddr;
+    sdTable->slabIndexShift = __builtin_ctz(minChunkSize);
+    sdTable->slabIndexLength = indexLength;
+
+    for (SDENTRY* entry = sdTable->headEntry; entry != NULL; entry = entry->nextEntry){
+        for (SLABPTR* slab = entry->slabPtr; slab != NULL; slab = slab->next){
+            set_slab_index(sdTable, slab->slabStartAddr, slab);
+        }
+    }
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_slab_index
+// Description  : records which slab starts at an address in the table's slab index,
+//                when the table has one
+//                  
+//
+// Inputs       : sdTable - table whose index to update
+//              : slabStartAddr - start address of the slab
+//              : slab - the slab, NULL once it is given back
+// Outputs      : None
+
+void set_slab_index(SDTABLE* sdTable, void* slabStartAddr, SLABPTR* slab){
+    if (sdTable->slabIndex == NULL){
+        return;
+    }
+    size_t index = (size_t)(slabStartAddr - sdTable->slabBase) >> sdTable->slabIndexShift;
+    __atomic_store_n(&sdTable->slabIndex[index], slab, __ATOMIC_RELEASE);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : slab_at
+// Description  : looks up the slab starting at an address in the table's slab index,
+//                without the depot's lock
+//                  
+//
+// Inputs       : sdTable - table whose index to use
+//              : slabStartAddr - an address the table's slabs could start at
+// Outputs      : the slab starting there
+//              : NULL if there is none, or the address is outside the tree
+
+SLABPTR* slab_at(SDTABLE* sdTable, void* slabStartAddr){
+    if ((sdTable->slabIndex == NULL) || (slabStartAddr < sdTable->slabBase)){
+        return NULL;
+    }
+    size_t index = (size_t)(slabStartAddr - sdTable->slabBase) >> sdTable->slabIndexShift;
+    if (index >= sdTable->slabIndexLength){
+        return NULL;
+    }
+    return __atomic_load_n(&sdTable->slabIndex[index], __ATOMIC_ACQUIRE);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_grow
+// Description  : gets a new slab for an object cache from the buddy tree, runs the
+//                cache's constructor on every object in it and puts it at the front
+//
+// Inputs       : cache - cache to grow
+//              : buddyTree - tree the cache's slabs come from
+// Outputs      : the new slab
+//              : NULL if there is no hole big enough
+
+CACHESLAB* cache_grow(MYCACHE* cache, BUDDYTREE* buddyTree){
+    TREENODE* slabNode = create_new_memory_node(buddyTree, cache->slabSize, LIFETIME_DEFAULT);
+    if (slabNode == NULL){
+        return NULL;
+    }
+
+    // the slab size leaves room to align the first object, whatever the chunk's own alignment
+    CACHESLAB* slab = malloc(sizeof(CACHESLAB));
+    slab->slabStartAddr = slabNode->startAddr;
+    slab->firstObj = (void*)(((uintptr_t)slabNode->startAddr + cache->align - 1) & ~((uintptr_t)cache->align - 1));
+    slab->freeMap = ~0ULL >> (64 - CACHE_OBJS_PER_SLAB);
+    slab->freeCount = CACHE_OBJS_PER_SLAB;
+
+    // objects are constructed once, here, and stay constructed while they are free
+    if (cache->ctor != NULL){
+        for (int i = 0; i < CACHE_OBJS_PER_SLAB; i++){
+            cache->ctor(slab->firstObj + i * cache->objSize);
+        }
+    }
+
+    slab->next = cache->slabs;
+    cache->slabs = slab;
+    return slab;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_alloc_object
+// Description  : takes a free object from the cache. slabs with free objects are kept
+//                at the front of the list, so the first slab has one unless all are full
+//
+// Inputs       : cache - cache to allocate from
+//              : buddyTree - tree the cache's slabs come from
+// Outputs      : pointer to a constructed object
+//              : NULL if the cache needed a new slab and there was no hole for it
+
+void* cache_alloc_object(MYCACHE* cache, BUDDYTREE* buddyTree){
+    CACHESLAB* slab = cache->slabs;
+    if ((slab == NULL) || (slab->freeCount == 0)){
+        slab = cache_grow(cache, buddyTree);
+        if (slab == NULL){
+            return NULL;
+        }
+    }
+
+    int index = __builtin_ctzll(slab->freeMap);
+    slab->freeMap &= ~(1ULL << index);
+    slab->freeCount--;
+
+    // a slab that just filled up goes behind the ones that still have room
+    if ((slab->freeCount == 0) && (slab->next != NULL) && (slab->next->freeCount > 0)){
+        cache->slabs = slab->next;
+        CACHESLAB* travPointer = cache->slabs;
+        while ((travPointer->next != NULL) && (travPointer->next->freeCount > 0)){
+            travPointer = travPointer->next;
+        }
+        slab->next = travPointer->next;
+        travPointer->next = slab;
+    }
+
+    return slab->firstObj + index * cache->objSize;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_free_object
+// Description  : gives an object back to its slab. an object has no header, its slab is
+//                found from its offset, since slabs are buddy chunks aligned to their size
+//
+// Inputs       : cache - cache the object came from
+//              : buddyTree - tree the cache's slabs come from
+//              : obj - object returned by cache_alloc_object
+// Outputs      : None
+
+void cache_free_object(MYCACHE* cache, BUDDYTREE* buddyTree, void* obj){
+    FREE_CHECK((obj >= buddyTree->root->startAddr) && (obj < buddyTree->root->startAddr + buddyTree->totalMemSize), "invalid pointer", obj);
+    long offset = obj - buddyTree->root->startAddr;
+    void* slabStartAddr = buddyTree->root->startAddr + (offset & ~((long)cache->slabSize - 1));
+
+    CACHESLAB* prevSlab = NULL;
+    CACHESLAB* slab = cache->slabs;
+    while ((slab != NULL) && (slab->slabStartAddr != slabStartAddr)){
+        prevSlab = slab;
+        slab = slab->next;
+    }
+    FREE_CHECK(slab != NULL, "pointer not from this cache", obj);
+
+    long objOffset = obj - slab->firstObj;
+    FREE_CHECK((objOffset >= 0) && ((size_t)objOffset % cache->objSize == 0) && ((size_t)objOffset / cache->objSize < CACHE_OBJS_PER_SLAB), "pointer into the middle of an object", obj);
+    int index = (size_t)objOffset / cache->objSize;
+    FREE_CHECK((slab->freeMap & (1ULL << index)) == 0, "double free", obj);
+
+    slab->freeMap |= 1ULL << index;
+    slab->freeCount++;
+
+    // give an empty slab back, unless it is the cache's last one
+    if ((slab->freeCount == CACHE_OBJS_PER_SLAB) && ((prevSlab != NULL) || (slab->next != NULL))){
+        if (prevSlab == NULL){
+            cache->slabs = slab->next;
+        } else {
+            prevSlab->next = slab->next;
+        }
+        cache_release_slab(cache, buddyTree, slab);
+        return;
+    }
+
+    // a slab that was full has room again, move it to the front
+    if ((slab->freeCount == 1) && (prevSlab != NULL)){
+        prevSlab->next = slab->next;
+        slab->next = cache->slabs;
+        cache->slabs = slab;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_release_slab
+// Description  : destructs every object of a slab, gives its chunk back to the buddy
+//                tree and frees the slab. the slab must already be off the cache's list
+//
+// Inputs       : cache - cache the slab belongs to
+//              : buddyTree - tree the slab came from
+//              : slab - slab to release
+// Outputs      : None
+
+void cache_release_slab(MYCACHE* cache, BUDDYTREE* buddyTree, CACHESLAB* slab){
+    if (cache->dtor != NULL){
+        for (int i = 0; i < CACHE_OBJS_PER_SLAB; i++){
+            cache->dtor(slab->firstObj + i * cache->objSize);
+        }
+    }
+    release_memory_node(buddyTree, find_node_by_address(buddyTree->root, slab->slabStartAddr));
+    free(slab);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : next_sample_gap
+// Description  : draws the number of bytes until the next sample. exponential gaps make
+//                sampling a Poisson process over the allocated bytes, so every byte has
+//                the same chance of being sampled whatever the allocation pattern
+//
+// Inputs       : profiler - profiler to draw for
+// Outputs      : gap in bytes, at least 1
+
+static long next_sample_gap(PROFILER* profiler){
+    // xorshift64
+    unsigned long x = profiler->rngState;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    profiler->rngState = x;
+
+    // uniform in (0, 1] from the top 53 bits
+    double uniform = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return (long)(-log(uniform) * profiler->sampleInterval) + 1;
+}
+
+
+PROFILER* init_profiler(long sampleInterval){
+    PROFILER* profiler = calloc(1, sizeof(PROFILER));
+    profiler->sampleInterval = sampleInterval;
+    profiler->rngState = ((unsigned long)(uintptr_t)profiler ^ (unsigned long)sampleInterval) | 1;
+    profiler->bytesUntilSample = next_sample_gap(profiler);
+    return profiler;
+}
+
+
+void destroy_profiler(PROFILER* profiler){
+    for (int i = 0; i < PROFILE_STACK_BUCKETS; i++){
+        STACKBUCKET* bucket = profiler->stacks[i];
+        while (bucket != NULL){
+            STACKBUCKET* next = bucket->next;
+            free(bucket);
+            bucket = next;
+        }
+    }
+    for (int i = 0; i < PROFILE_SAMPLE_BUCKETS; i++){
+        HEAPSAMPLE* sample = profiler->samples[i];
+        while (sample != NULL){
+            HEAPSAMPLE* next = sample->next;
+            free(sample);
+            sample = next;
+        }
+    }
+    free(profiler);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : capture_stack
+// Description  : walks the frame pointer chain of the calling thread. every frame is
+//                checked to be above the one before and below the top of the thread's
+//                stack, so a frame built without a frame pointer ends the walk instead
+//                of reading outside the stack
+//
+// Inputs       : pcs - array to put the return addresses in
+//              : maxDepth - number of entries in pcs
+//              : skipFrames - number of innermost frames (the profiler's own) to leave out
+// Outputs      : number of return addresses found
+
+static __thread char* threadStackTop;
+
+static int capture_stack(void** pcs, int maxDepth, int skipFrames){
+    // find the top of this thread's stack the first time it samples
+    if (threadStackTop == NULL){
+        pthread_attr_t attr;
+        void* stackAddr;
+        size_t stackSize;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0){
+            if (pthread_attr_getstack(&attr, &stackAddr, &stackSize) == 0){
+                threadStackTop = (char*)stackAddr + stackSize;
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+
+    // without the stack bounds only the direct caller is safe to record
+    if (threadStackTop == NULL){
+        pcs[0] = __builtin_return_address(0);
+        return 1;
+    }
+
+    void** frame = __builtin_frame_address(0);
+    int depth = 0;
+    while ((depth < maxDepth) && ((char*)(frame + 2) <= threadStackTop)){
+        void* pc = frame[1];
+        if (pc == NULL){
+            break;
+        }
+        if (skipFrames > 0){
+            skipFrames--;
+        } else {
+            pcs[depth++] = pc;
+        }
+
+        void** next = frame[0];
+        if ((next <= frame) || ((char*)next - (char*)frame > PROFILE_MAX_FRAME_SIZE) || (((uintptr_t)next & (sizeof(void*) - 1)) != 0)){
+            break;
+        }
+        frame = next;
+    }
+    return depth;
+}
+
+
+static unsigned int hash_pointer(void* ptr){
+    uintptr_t x = (uintptr_t)ptr;
+    x ^= x >> 17;
+    x *= 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(x >> 32);
+}
+
+
+void record_sample(PROFILER* profiler, void* ptr, size_t size){
+    profiler->bytesUntilSample = next_sample_gap(profiler);
+
+    void* pcs[PROFILE_MAX_DEPTH];
+    // leave out the return into record_sample itself, the stack starts in the heap's malloc
+    int depth = capture_stack(pcs, PROFILE_MAX_DEPTH, 1);
+
+    // find the bucket of this call stack, or start one
+    unsigned int hash = depth;
+    for (int i = 0; i < depth; i++){
+        hash = hash * 31 + hash_pointer(pcs[i]);
+    }
+    STACKBUCKET** chain = &profiler->stacks[hash % PROFILE_STACK_BUCKETS];
+    STACKBUCKET* bucket = *chain;
+    while ((bucket != NULL) && ((bucket->depth != depth) || (memcmp(bucket->pcs, pcs, depth * sizeof(void*)) != 0))){
+        bucket = bucket->next;
+    }
+    if (bucket == NULL){
+        bucket = calloc(1, sizeof(STACKBUCKET));
+        memcpy(bucket->pcs, pcs, depth * sizeof(void*));
+        bucket->depth = depth;
+        bucket->next = *chain;
+        *chain = bucket;
+    }
+    bucket->allocObjs++;
+    bucket->allocBytes += size;
+    bucket->inuseObjs++;
+    bucket->inuseBytes += size;
+
+    // remember the allocation until it is freed
+    HEAPSAMPLE* sample = malloc(sizeof(HEAPSAMPLE));
+    sample->ptr = ptr;
+    sample->size = size;
+    sample->bucket = bucket;
+    HEAPSAMPLE** sampleChain = &profiler->samples[hash_pointer(ptr) % PROFILE_SAMPLE_BUCKETS];
+    sample->next = *sampleChain;
+    *sampleChain = sample;
+    profiler->liveSamples++;
+}
+
+
+void forget_sample(PROFILER* profiler, void* ptr){
+    HEAPSAMPLE** link = &profiler->samples[hash_pointer(ptr) % PROFILE_SAMPLE_BUCKETS];
+    while (*link != NULL){
+        HEAPSAMPLE* sample = *link;
+        if (sample->ptr == ptr){
+            sample->bucket->inuseObjs--;
+            sample->bucket->inuseBytes -= sample->size;
+            *link = sample->next;
+            free(sample);
+            profiler->liveSamples--;
+            return;
+        }
+        link = &sample->next;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : forget_samples_between
+// Description  : removes every live sample in a range of memory that was released in
+//                bulk, since no free of those allocations will ever come
+//
+// Inputs       : profiler - profiler to update
+//              : start - start of the released memory
+//              : end - end of the released memory
+// Outputs      : None
+
+void forget_samples_between(PROFILER* profiler, void* start, void* end){
+    for (int i = 0; (i < PROFILE_SAMPLE_BUCKETS) && (profiler->liveSamples > 0); i++){
+        HEAPSAMPLE** link = &profiler->samples[i];
+        while (*link != NULL){
+            HEAPSAMPLE* sample = *link;
+            if ((sample->ptr < start) || (sample->ptr >= end)){
+                link = &sample->next;
+                continue;
+            }
+            sample->bucket->inuseObjs--;
+            sample->bucket->inuseBytes -= sample->size;
+            *link = sample->next;
+            free(sample);
+            profiler->liveSamples--;
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_heap_profile
+// Description  : writes the samples of one or more profilers in the gperftools heap_v2
+//                text format that pprof reads: a totals line, one line per call stack,
+//                then the process's memory map to symbolize the addresses with
+//
+// Inputs       : file - file to write to
+//              : profilers - profilers to write, all with the same sample interval
+//              : profilerCount - number of profilers
+// Outputs      : None
+
+void write_heap_profile(FILE* file, PROFILER** profilers, int profilerCount){
+    long totals[4] = {0, 0, 0, 0};
+    for (int p = 0; p < profilerCount; p++){
+        for (int i = 0; i < PROFILE_STACK_BUCKETS; i++){
+            for (STACKBUCKET* bucket = profilers[p]->stacks[i]; bucket != NULL; bucket = bucket->next){
+                totals[0] += bucket->inuseObjs;
+                totals[1] += bucket->inuseBytes;
+                totals[2] += bucket->allocObjs;
+                totals[3] += bucket->allocBytes;
+            }
+        }
+    }
+
+    fprintf(file, "heap profile: %6ld: %8ld [%6ld: %8ld] @ heap_v2/%ld\n",
+            totals[0], totals[1], totals[2], totals[3], profilers[0]->sampleInterval);
+    for (int p = 0; p < profilerCount; p++){
+        for (int i = 0; i < PROFILE_STACK_BUCKETS; i++){
+            for (STACKBUCKET* bucket = profilers[p]->stacks[i]; bucket != NULL; bucket = bucket->next){
+                fprintf(file, "%6ld: %8ld [%6ld: %8ld] @", bucket->inuseObjs, bucket->inuseBytes, bucket->allocObjs, bucket->allocBytes);
+                for (int d = 0; d < bucket->depth; d++){
+                    fprintf(file, " %p", bucket->pcs[d]);
+                }
+                fprintf(file, "\n");
+            }
+        }
+    }
+
+    // pprof maps the addresses back to functions with the memory map
+    fprintf(file, "\nMAPPED_LIBRARIES:\n");
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps != NULL){
+        char buffer[4096];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), maps)) > 0){
+            fwrite(buffer, 1, n, file);
+        }
+        fclose(maps);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : format_persistent_region
+// Description  : lays out an empty heap in a region: the header, then the implicit buddy
+//                tree with every node free, and claims the chunk at the start of the region
+//                for the two of them. the magic number is written last, so a region that
+//                was only partly formatted is never taken for a heap. initState is left to
+//                attach_persistent_region
+//
+// Inputs       : startOfMemory - start of the region
+//              : memSize - number of bytes in the region, a power of two
+//              : type - enum malloc_type of the heap, MALLOC_BUDDY or MALLOC_SLAB
+//              : minChunkSize - smallest chunk the tree hands out (a power of two)
+//              : objsPerSlab - number of objects in each slab
+// Outputs      : header of the region
+//              : NULL if the region is too small or the geometry is not supported
+
+PREGION* format_persistent_region(void* startOfMemory, size_t memSize, enum malloc_type type, int minChunkSize, int objsPerSlab){
+    init_order_table();
+    if ((memSize & (memSize - 1)) != 0 || (minChunkSize <= 0) || ((minChunkSize & (minChunkSize - 1)) != 0) || (memSize <= (size_t)minChunkSize)){
+        return NULL;
+    }
+    if ((objsPerSlab <= 0) || (objsPerSlab > PERSIST_MAX_OBJS_PER_SLAB)){
+        return NULL;
+    }
+
+    // the bookkeeping must leave at least half of the region to the heap. nothing is
+    // written before that is known, so a region that cannot be formatted is left as it was
+    int minOrder = __builtin_ctzl(minChunkSize);
+    int maxOrder = __builtin_ctzl(memSize);
+    size_t treeOffset = (sizeof(PREGION) + 63) & ~63UL;
+    int levels = maxOrder - minOrder;
+    size_t metaSize = treeOffset + ((size_t)2 << levels) - 1;
+    int metaOrder = size_to_order(metaSize);
+    if (metaOrder >= maxOrder){
+        return NULL;
+    }
+
+    PREGION* region = startOfMemory;
+    region->minOrder = minOrder;
+    region->maxOrder = maxOrder;
+    region->treeOffset = treeOffset;
+    region->version = PERSIST_VERSION;
+    region->policy = type;
+    region->regionSize = memSize;
+    region->objsPerSlab = objsPerSlab;
+    region->reserved = 0;
+    region->lock = 0;
+    region->slabs = 0;
+    region->root = 0;
+
+    // every node starts out as one free chunk of its own order
+    unsigned char* tree = startOfMemory + region->treeOffset;
+    for (int depth = 0; depth <= levels; depth++){
+        memset(tree + ((size_t)1 << depth) - 1, region->maxOrder - depth + 1, (size_t)1 << depth);
+    }
+
+    // the leftmost chunk holds the header and the tree, it is never freed
+    persistent_alloc_chunk(region, (metaOrder > (int)region->minOrder) ? metaOrder : (int)region->minOrder);
+
+    __atomic_store_n(&region->magic, PERSIST_MAGIC, __ATOMIC_RELEASE);
+    return region;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_persistent_region
+// Description  : checks that a region already holds a heap, so that it can be used as it
+//                is. nothing is rebuilt, the region's bookkeeping is used in place
+//
+// Inputs       : startOfMemory - start of the region
+//              : memSize - number of bytes in the region
+//              : type - enum malloc_type the heap is expected to have
+// Outputs      : header of the region
+//              : NULL if the region does not hold a heap of that type and size
+
+PREGION* open_persistent_region(void* startOfMemory, size_t memSize, enum malloc_type type){
+    init_order_table();
+
+    PREGION* region = startOfMemory;
+    if ((memSize < sizeof(PREGION)) || (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != PERSIST_MAGIC)){
+        return NULL;
+    }
+    if ((region->version != PERSIST_VERSION) || (region->policy != (uint32_t)type) || (region->regionSize != memSize)){
+        return NULL;
+    }
+    return region;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : futex_wait, futex_wake
+// Description  : sleep while a word of shared memory holds the expected value, and wake
+//                up to count processes sleeping on it. the futexes are not private, so
+//                they work across processes mapping the same memory
+//
+// Inputs       : word - word in shared memory
+//              : expected - value the word must still hold for the caller to sleep
+//              : timeout - longest time to sleep (NULL for no limit)
+//              : count - most sleepers to wake
+// Outputs      : None
+
+static void futex_wait(uint32_t* word, uint32_t expected, const struct timespec* timeout){
+    syscall(SYS_futex, word, FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t* word, int count){
+    syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : region_is_zero
+// Description  : checks that every byte of a region is zero, as it is in a new file,
+//                memfd or shared memory object, so that formatting it loses no data
+//
+// Inputs       : startOfMemory - start of the region, 8 byte aligned
+//              : memSize - number of bytes in the region, a multiple of 8
+// Outputs      : true if the region is all zero
+
+static bool region_is_zero(void* startOfMemory, size_t memSize){
+    const uint64_t* words = startOfMemory;
+    for (size_t i = 0; i < memSize / sizeof(uint64_t); i++){
+        if (words[i] != 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : attach_persistent_region
+// Description  : opens the heap in a region that other processes may be opening at the
+//                same time. the first process to move initState from uninitialized to
+//                initializing formats the region, the others sleep until it is ready.
+//                initState is only trusted once the magic number and version say the
+//                header has this layout, or the region is still all zero
+//
+// Inputs       : startOfMemory - start of the region
+//              : memSize - number of bytes in the region, a power of two
+//              : type - enum malloc_type of the heap, MALLOC_BUDDY or MALLOC_SLAB
+//              : minChunkSize - smallest chunk the tree hands out, if the region is formatted
+//              : objsPerSlab - number of objects in each slab, if the region is formatted
+//              : mayFormat - boolean for whether a zero filled region may be formatted, and
+//                      a region another process is formatting waited for
+// Outputs      : header of the region
+//              : NULL if the region holds something else, could not be formatted, or was
+//                left initializing for longer than PERSIST_INIT_TIMEOUT_MS
+
+PREGION* attach_persistent_region(void* startOfMemory, size_t memSize, enum malloc_type type, int minChunkSize, int objsPerSlab, bool mayFormat){
+    PREGION* region = startOfMemory;
+    if (memSize < sizeof(PREGION)){
+        return NULL;
+    }
+
+    // a region holding something else is refused before its setup state is trusted
+    uint64_t magic = __atomic_load_n(&region->magic, __ATOMIC_ACQUIRE);
+    if ((magic != 0) && ((magic != PERSIST_MAGIC) || (region->version != PERSIST_VERSION))){
+        return NULL;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long deadline = now.tv_sec * 1000000000L + now.tv_nsec + PERSIST_INIT_TIMEOUT_MS * 1000000L;
+
+    uint32_t state = __atomic_load_n(&region->initState, __ATOMIC_ACQUIRE);
+    while (state != PERSIST_READY){
+        if (!mayFormat){
+            return NULL;
+        }
+        if (state == PERSIST_INITIALIZING){
+            // a process that died while formatting leaves the state behind, so the wait is bounded
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long remaining = deadline - (now.tv_sec * 1000000000L + now.tv_nsec);
+            if (remaining <= 0){
+                return NULL;
+            }
+            struct timespec timeout = {remaining / 1000000000L, remaining % 1000000000L};
+            futex_wait(&region->initState, PERSIST_INITIALIZING, &timeout);
+            state = __atomic_load_n(&region->initState, __ATOMIC_ACQUIRE);
+        } else if (state != PERSIST_UNINITIALIZED){
+            return NULL;
+        } else if (!region_is_zero(startOfMemory, memSize)){
+            // either it holds something else, or another process has started formatting it
+            state = __atomic_load_n(&region->initState, __ATOMIC_ACQUIRE);
+            if (state == PERSIST_UNINITIALIZED){
+                return NULL;
+            }
+        } else if (__atomic_compare_exchange_n(&region->initState, &state, PERSIST_INITIALIZING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            // a region that could not be formatted is left untouched, for the next try
+            bool formatted = (format_persistent_region(startOfMemory, memSize, type, minChunkSize, objsPerSlab) != NULL);
+            __atomic_store_n(&region->initState, formatted ? PERSIST_READY : PERSIST_UNINITIALIZED, __ATOMIC_RELEASE);
+            futex_wake(&region->initState, INT_MAX);
+            return formatted ? region : NULL;
+        }
+    }
+
+    return open_persistent_region(startOfMemory, memSize, type);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lock_persistent_region
+// Description  : takes the region's lock. an uncontended lock is one compare and swap,
+//                a contended one marks the word as having waiters and sleeps on it
+//
+// Inputs       : region - header of the region
+// Outputs      : None
+
+void lock_persistent_region(PREGION* region){
+    uint32_t state = 0;
+    if (__atomic_compare_exchange_n(&region->lock, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        return;
+    }
+    if (state != 2){
+        state = __atomic_exchange_n(&region->lock, 2, __ATOMIC_ACQUIRE);
+    }
+    while (state != 0){
+        futex_wait(&region->lock, 2, NULL);
+        state = __atomic_exchange_n(&region->lock, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unlock_persistent_region
+// Description  : drops the region's lock, and wakes one waiter if there are any
+//
+// Inputs       : region - header of the region
+// Outputs      : None
+
+void unlock_persistent_region(PREGION* region){
+    if (__atomic_exchange_n(&region->lock, 0, __ATOMIC_RELEASE) == 2){
+        futex_wake(&region->lock, 1);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : update_persistent_parents
+// Description  : recomputes the nodes above a node of the implicit tree after it changed.
+//                a node whose children are both wholly free is wholly free itself, which
+//                is how freed buddies merge
+//
+// Inputs       : tree - implicit tree of the region
+//              : index - index of the node that changed
+//              : order - order of that node
+// Outputs      : None
+
+static void update_persistent_parents(unsigned char* tree, size_t index, int order){
+    while (index > 0){
+        index = (index - 1) / 2;
+        unsigned char left = tree[2 * index + 1];
+        unsigned char right = tree[2 * index + 2];
+        if ((left == order + 1) && (right == order + 1)){
+            tree[index] = order + 2;
+        } else {
+            tree[index] = (left > right) ? left : right;
+        }
+        order++;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : persistent_alloc_chunk
+// Description  : takes the leftmost free chunk of the given order from the implicit tree.
+//                the nodes below an allocated chunk are left as they were, wholly free
+//
+// Inputs       : region - header of the region
+//              : order - log base 2 of the chunk's size
+// Outputs      : offset of the chunk from the start of the region
+//              : 0 if there is no free chunk that big
+
+uint64_t persistent_alloc_chunk(PREGION* region, int order){
+    unsigned char* tree = (void*)region + region->treeOffset;
+    if ((order > (int)region->maxOrder) || (tree[0] < order + 1)){
+        return 0;
+    }
+
+    // walk down to a free node of the right order, going left whenever there is room there
+    size_t index = 0;
+    int nodeOrder = region->maxOrder;
+    while (nodeOrder > order){
+        index = (tree[2 * index + 1] >= order + 1) ? 2 * index + 1 : 2 * index + 2;
+        nodeOrder--;
+    }
+
+    tree[index] = 0;
+    update_persistent_parents(tree, index, order);
+
+    // a node's offset is its position on its level times its size
+    int depth = region->maxOrder - order;
+    return (uint64_t)(index - (((size_t)1 << depth) - 1)) << order;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : persistent_find_chunk
+// Description  : finds the allocated chunk holding the given offset. walking up from the
+//                smallest chunk at the offset, the first node marked 0 is the allocated
+//                one, since nodes below an allocated chunk keep their free marks
+//
+// Inputs       : region - header of the region
+//              : offset - offset from the start of the region
+//              : order - set to the order of the chunk found
+// Outputs      : offset of the start of the chunk
+//              : 0 if no allocated chunk holds offset
+
+uint64_t persistent_find_chunk(PREGION* region, uint64_t offset, int* order){
+    if (offset >= region->regionSize){
+        return 0;
+    }
+
+    unsigned char* tree = (void*)region + region->treeOffset;
+    int levels = region->maxOrder - region->minOrder;
+    size_t index = ((size_t)1 << levels) - 1 + (offset >> region->minOrder);
+    int nodeOrder = region->minOrder;
+    while (tree[index] != 0){
+        if (index == 0){
+            return 0;
+        }
+        index = (index - 1) / 2;
+        nodeOrder++;
+    }
+
+    *order = nodeOrder;
+    return offset & ~(((uint64_t)1 << nodeOrder) - 1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : persistent_free_chunk
+// Description  : marks an allocated chunk of the implicit tree free and merges it with
+//                its buddies
+//
+// Inputs       : region - header of the region
+//              : chunkOffset - offset of the chunk, from persistent_find_chunk
+//              : order - order of the chunk
+// Outputs      : None
+
+void persistent_free_chunk(PREGION* region, uint64_t chunkOffset, int order){
+    unsigned char* tree = (void*)region + region->treeOffset;
+    int depth = region->maxOrder - order;
+    size_t index = ((size_t)1 << depth) - 1 + (chunkOffset >> order);
+    tree[index] = order + 1;
+    update_persistent_parents(tree, index, order);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : persistent_buddy_malloc
+// Description  : allocates a chunk from a file-backed region. chunks have no header, their
+//                order is found again from the implicit tree when they are freed
+//
+// Inputs       : region - header of the region
+//              : size - number of bytes the user asked for
+// Outputs      : pointer to the start of the chunk
+//              : NULL if there is no free chunk big enough
+
+void* persistent_buddy_malloc(PREGION* region, size_t size){
+    if (size > region->regionSize){
+        return NULL;
+    }
+    int order = size_to_order(size);
+    if (order < (int)region->minOrder){
+        order = region->minOrder;
+    }
+
+    uint64_t chunkOffset = persistent_alloc_chunk(region, order);
+    if (chunkOffset == 0){
+        return NULL;
+    }
+    return (void*)region + chunkOffset;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : persistent_buddy_free
+// Description  : gives a chunk from persistent_buddy_malloc back to its region
+//
+// Inputs       : region - header of the region
+//              : ptr - pointer returned by persistent_buddy_malloc
+// Outputs      : None
+
+void persistent_buddy_free(PREGION* region, void* ptr){
+    FREE_CHECK((ptr > (void*)region) && (ptr < (void*)region + region->regionSize), "invalid pointer", ptr);
+    uint64_t offset = ptr - (void*)region;
+    int order;
+    uint64_t chunkOffset = persistent_find_chunk(region, offset, &order);
+    FREE_CHECK(chunkOffset != 0, "invalid pointer or double free", ptr);
+    FREE_CHECK(chunkOffset == offset, "pointer into the middle of a chunk", ptr);
+
+#ifdef MY_HARDENED
+    memset(ptr, POISON_BYTE, (size_t)1 << order);
+#endif
+
+    persistent_free_chunk(region, chunkOffset, order);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : persistent_slab_malloc
+// Description  : allocates an object from the slabs of a file-backed region, getting a
+//                new slab from the implicit tree when none of the size has room. a new
+//                slab goes on the front of the region's list, and persistent_slab_free
+//                moves a full slab there once it has room again. a slab that fills up
+//                stays where it is and the search steps over it
+//
+// Inputs       : region - header of the region
+//              : size - number of bytes the user asked for
+// Outputs      : pointer to the object
+//              : NULL if no new slab could be allocated
+
+void* persistent_slab_malloc(PREGION* region, size_t size){
+    if ((size > region->regionSize / region->objsPerSlab) || (size > UINT32_MAX - PERSIST_ALIGNMENT)){
+        return NULL;
+    }
+    uint32_t objSize = (size + PERSIST_ALIGNMENT - 1) & ~(PERSIST_ALIGNMENT - 1);
+    if (objSize == 0){
+        objSize = PERSIST_ALIGNMENT;
+    }
+
+    PSLAB* slab = NULL;
+    uint64_t slabOffset = region->slabs;
+    while (slabOffset != 0){
+        PSLAB* travSlab = (void*)region + slabOffset;
+        if ((travSlab->objSize == objSize) && (travSlab->freeCount > 0)){
+            slab = travSlab;
+            break;
+        }
+        slabOffset = travSlab->next;
+    }
+
+    // a new slab goes on the front of the list
+    if (slab == NULL){
+        int order = size_to_order(sizeof(PSLAB) + (size_t)objSize * region->objsPerSlab);
+        if (order < (int)region->minOrder){
+            order = region->minOrder;
+        }
+        slabOffset = persistent_alloc_chunk(region, order);
+        if (slabOffset == 0){
+            return NULL;
+        }
+        slab = (void*)region + slabOffset;
+        slab->objSize = objSize;
+        slab->freeCount = region->objsPerSlab;
+        slab->freeMap = ~0ULL >> (64 - region->objsPerSlab);
+        slab->prev = 0;
+        slab->next = region->slabs;
+        if (region->slabs != 0){
+            ((PSLAB*)((void*)region + region->slabs))->prev = slabOffset;
+        }
+        region->slabs = slabOffset;
+    }
+
+    int index = __builtin_ctzll(slab->freeMap);
+    slab->freeMap &= ~(1ULL << index);
+    slab->freeCount--;
+    return (void*)slab + sizeof(PSLAB) + (size_t)index * objSize;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : persistent_slab_free
+// Description  : gives an object back to its slab. the slab is the allocated chunk
+//                holding the object, found from the implicit tree, and goes back to the
+//                tree once it is empty
+//
+// Inputs       : region - header of the region
+//              : ptr - pointer returned by persistent_slab_malloc
+// Outputs      : None
+
+void persistent_slab_free(PREGION* region, void* ptr){
+    FREE_CHECK((ptr > (void*)region) && (ptr < (void*)region + region->regionSize), "invalid pointer", ptr);
+    int order;
+    uint64_t slabOffset = persistent_find_chunk(region, ptr - (void*)region, &order);
+    FREE_CHECK(slabOffset != 0, "invalid pointer", ptr);
+
+    PSLAB* slab = (void*)region + slabOffset;
+    long objOffset = ptr - ((void*)slab + sizeof(PSLAB));
+    FREE_CHECK((objOffset >= 0) && (objOffset % slab->objSize == 0) && (objOffset / slab->objSize < region->objsPerSlab), "pointer into the middle of an object", ptr);
+    int index = objOffset / slab->objSize;
+    FREE_CHECK((slab->freeMap & (1ULL << index)) == 0, "double free", ptr);
+
+#ifdef MY_HARDENED
+    memset(ptr, POISON_BYTE, slab->objSize);
+#endif
+
+    slab->freeMap |= 1ULL << index;
+    slab->freeCount++;
+
+    // a slab that is empty, or that was full and has room again, comes off its place in the list
+    if ((slab->freeCount != region->objsPerSlab) && ((slab->freeCount != 1) || (slab->prev == 0))){
+        return;
+    }
+    if (slab->prev == 0){
+        region->slabs = slab->next;
+    } else {
+        ((PSLAB*)((void*)region + slab->prev))->next = slab->next;
+    }
+    if (slab->next != 0){
+        ((PSLAB*)((void*)region + slab->next))->prev = slab->prev;
+    }
+
+    if (slab->freeCount == region->objsPerSlab){
+        persistent_free_chunk(region, slabOffset, order);
+        return;
+    }
+
+    // it goes to the front, with the slabs that have room
+    slab->prev = 0;
+    slab->next = region->slabs;
+    if (region->slabs != 0){
+        ((PSLAB*)((void*)region + region->slabs))->prev = slabOffset;
+    }
+    region->slabs = slabOffset;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : measure_persistent_node
+// Description  : adds up the free memory below a node of the implicit tree and finds
+//                the biggest hole there
+//
+// Inputs       : tree - implicit tree of the region
+//              : index - index of the node
+//              : order - order of the node
+//              : minOrder - order of the smallest chunk
+//              : totalFree - incremented by the bytes in every hole
+//              : largestFree - raised to the size of the biggest hole
+// Outputs      : None
+
+static void measure_persistent_node(unsigned char* tree, size_t index, int order, int minOrder, size_t* totalFree, size_t* largestFree){
+    if (tree[index] == 0){
+        return;
+    }
+
+    if (tree[index] == order + 1){
+        *totalFree += (size_t)1 << order;
+        if (((size_t)1 << order) > *largestFree){
+            *largestFree = (size_t)1 << order;
+        }
+        return;
+    }
+
+    if (order > minOrder){
+        measure_persistent_node(tree, 2 * index + 1, order - 1, minOrder, totalFree, largestFree);
+        measure_persistent_node(tree, 2 * index + 2, order - 1, minOrder, totalFree, largestFree);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : measure_persistent_holes
+// Description  : adds up the free memory of a file-backed region and finds its biggest hole
+//
+// Inputs       : region - header of the region
+//              : totalFree - incremented by the bytes in every hole
+//              : largestFree - raised to the size of the biggest hole
+// Outputs      : None
+
+void measure_persistent_holes(PREGION* region, size_t* totalFree, size_t* largestFree){
+    measure_persistent_node((void*)region + region->treeOffset, 0, region->maxOrder, region->minOrder, totalFree, largestFree);
 }
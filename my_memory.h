@@ -3,12 +3,112 @@
 
 #include "interface.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <time.h>
+
 // Declare your own data structures and functions here...
+
+// Size of the chunks an arena gets from the buddy tree, and the alignment of arena objects
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 8
+
+// Size of a transparent/explicit huge page, the unit TLB-aware placement packs into
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Most NUMA nodes a heap will split its memory across
+#define MAX_NUMA_NODES 64
+
+// Sizes up to this many bytes have their order looked up instead of computed
+#define SMALL_ORDER_TABLE_SIZE 4096
+
+// Segregated placement divides the tree into regions of this size (but at least this many
+// regions), and puts chunks below SEGREGATION_SMALL_SIZE in different regions than bigger
+// ones. Classes are 3 lifetimes for each of the 2 size bands.
+#define SEGREGATION_REGION_SIZE (1024 * 1024)
+#define SEGREGATION_MIN_REGIONS 8
+#define SEGREGATION_SMALL_SIZE 4096
+#define SEGREGATION_CLASSES 6
+
+// Smallest hole the decay pass hands back to the OS
+#define DECAY_MIN_SIZE (64 * 1024)
+
+// Headers hold the size as a 64-bit number. Hardened builds (-DMY_HARDENED, make hardened)
+// keep the size in the low HEADER_SIZE_BITS bits and a 16-bit canary, keyed by the chunk's
+// address, in the rest, and fill freed memory with POISON_BYTE
+#define HEADER_SIZE_BITS 48
+#define HEADER_CANARY 0xC0DEu
+#define POISON_BYTE 0xDD
+
+// Heap profiling keeps call stacks of at most PROFILE_MAX_DEPTH frames, and stops unwinding
+// at a frame bigger than PROFILE_MAX_FRAME_SIZE. Stacks and live samples are found through
+// chained hash tables of these many buckets
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_MAX_FRAME_SIZE (1024 * 1024)
+#define PROFILE_STACK_BUCKETS 1024
+#define PROFILE_SAMPLE_BUCKETS 4096
+
+// Number of free objects a slab magazine holds
+#define MAGAZINE_SIZE 16
+
+// Bitmap value of a slab object freed into a magazine: free for the user, but still held
+// by its slab
+#define SLAB_OBJ_CACHED 2
+
+// Number of magazine pairs, of any heap and object type, each thread keeps within reach
+// without a lock
+#define THREAD_MAGAZINE_SLOTS 64
+
+// Longest object cache name kept, and the number of objects in every cache slab (one
+// bit each in the slab's free map)
+#define CACHE_NAME_LEN 32
+#define CACHE_OBJS_PER_SLAB 64
+
+// File-backed regions start with a header marked with PERSIST_MAGIC and the PERSIST_VERSION
+// of their layout. Objects in their slabs are PERSIST_ALIGNMENT aligned, and a slab holds
+// at most 64 of them (one bit each in the slab's free map)
+#define PERSIST_MAGIC 0x5045524D48454150ULL
+#define PERSIST_VERSION 1
+#define PERSIST_ALIGNMENT 8
+#define PERSIST_MAX_OBJS_PER_SLAB 64
+
+// Setup states of a file-backed region, so that only one of the processes opening a new
+// region formats it. A region still initializing after PERSIST_INIT_TIMEOUT_MS was left
+// by a process that died while formatting it
+#define PERSIST_UNINITIALIZED 0
+#define PERSIST_INITIALIZING 1
+#define PERSIST_READY 2
+#define PERSIST_INIT_TIMEOUT_MS 2000
+
+// Checks made on free: a hardened build reports a failed check and aborts, other builds
+// ignore the free
+#ifdef MY_HARDENED
+#define FREE_CHECK(cond, message, ptr) do { if (!(cond)) report_heap_error(message, ptr); } while (0)
+#else
+#define FREE_CHECK(cond, message, ptr) do { if (!(cond)) return; } while (0)
+#endif
+
 typedef struct buddy_tree_struct BUDDYTREE;
 typedef struct tree_node_struct TREENODE;
 typedef struct slab_ptr_struct SLABPTR;
 typedef struct slab_descriptor_table_entry_struct SDENTRY;
 typedef struct slab_descriptor_table_struct SDTABLE;
+typedef struct magazine_struct MAGAZINE;
+typedef struct thread_magazines_struct THREADMAGS;
+typedef struct arena_chunk_struct ARENACHUNK;
+typedef struct arena_struct ARENA;
+typedef struct movable_struct MOVABLE;
+typedef struct my_heap_struct MYHEAP;
+typedef struct stack_bucket_struct STACKBUCKET;
+typedef struct heap_sample_struct HEAPSAMPLE;
+typedef struct profiler_struct PROFILER;
+typedef struct cache_slab_struct CACHESLAB;
+typedef struct my_cache_struct MYCACHE;
+typedef struct persistent_region_struct PREGION;
+typedef struct persistent_slab_struct PSLAB;
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -19,10 +119,34 @@ typedef struct slab_descriptor_table_struct SDTABLE;
 //
 // Variables     : root - refernce to the root node of the tree
 //               : totalMemSize - total amount of bytes in the tree handles
+//               : lazyCoalesce - boolean for whether freed holes are left unmerged until needed
+//               : deferredMerges - number of frees whose merge has been put off
+//               : mergeWatermark - number of deferred merges that forces a coalescing pass (0 for no limit)
+//               : orderTable - order of every allocated chunk keyed by offset, for header-less chunks (NULL if unused)
+//               : orderTableShift - log base 2 of the minimum chunk size, turns an offset into an orderTable index
+//               : touchedPages - boolean per huge page for whether a chunk was ever placed in it (NULL if
+//                      placement is not TLB-aware)
+//               : opCount - number of allocations and frees done on the tree
+//               : decayIdleOps - operations a hole must stay free before its pages are released (0 for never)
+//               : decayLazyFree - boolean for using MADV_FREE instead of MADV_DONTNEED
+//               : regionClasses - class that claimed each region, -1 if none or the region is wholly free
+//                      again (NULL if placement is not segregated)
+//               : regionSize - size of each region for segregated placement
 
 struct buddy_tree_struct{
     TREENODE* root;
-    int totalMemSize;
+    size_t totalMemSize;
+    bool lazyCoalesce;
+    int deferredMerges;
+    int mergeWatermark;
+    unsigned char* orderTable;
+    int orderTableShift;
+    unsigned char* touchedPages;
+    unsigned long opCount;
+    int decayIdleOps;
+    bool decayLazyFree;
+    signed char* regionClasses;
+    size_t regionSize;
 };
 
 
@@ -40,16 +164,20 @@ struct buddy_tree_struct{
 //               : left - refernce to the node's left child in the tree
 //               : right - refernce to the node's right child in the tree
 //               : slabBitField - bit field for which parts of slab are allocated
+//               : idleSince - the tree's operation count when this hole became free
+//               : released - boolean for whether this hole's pages were handed back to the OS
 
 struct tree_node_struct{
     bool isHole;
     bool isMem;
-    int size;
+    size_t size;
     void* startAddr;
     TREENODE* parent;
     TREENODE* left;
     TREENODE* right;
     unsigned int* slabBitField;
+    unsigned long idleSince;
+    bool released;
 };
 
 
@@ -61,12 +189,15 @@ struct tree_node_struct{
 //
 // Variables     : startAddr - the starting address of the slab (pre header)
 //               : slabBitMap - an integer array of (1|0)'s modeling which
-//                      memory chunks in the slab are in use or holes
+//                      memory chunks in the slab are in use or holes, or SLAB_OBJ_CACHED
+//                      for chunks sitting in a magazine
+//               : type - size of each object inside the slab, as in its entry
 //               : next - the next slab in the linked list
 
 struct slab_ptr_struct {
     void* slabStartAddr;
     unsigned int* slabBitMap;
+    size_t type;
     SLABPTR* next;
 };
 
@@ -83,14 +214,16 @@ struct slab_ptr_struct {
 //               : objUsed - current number of objects used inside slab
 //               : slabPtr - the head of a linked list of slabs
 //               : nextEntry - the entry following this one in the slab descriptor table
+//               : fullMagazines - depot of full magazines of this type
 
 struct slab_descriptor_table_entry_struct {
-    int type;
-    int size;
-    int objTotal;
-    int objUsed;
+    size_t type;
+    size_t size;
+    size_t objTotal;
+    size_t objUsed;
     SLABPTR* slabPtr; 
     SDENTRY* nextEntry;
+    MAGAZINE* fullMagazines;
 };
 
 
@@ -101,22 +234,367 @@ struct slab_descriptor_table_entry_struct {
 //                  
 //
 // Variables     : SDTableEntries - array of table entries
+//               : magazines - boolean for whether freed objects go to magazines instead of their slab
+//               : emptyMagazines - depot of empty magazines, shared by every type
+//               : id - number no other table gets, threads find their magazines of the table by it
+//               : depotLock - lock taken to trade magazines with the depots (NULL if the heap is
+//                      not thread safe)
+//               : threadMagazines - list of every thread's magazines of the table
+//               : slabIndex - the slab starting at each chunk of the tree (or NULL), which frees
+//                      into magazines are checked against (NULL until magazines are first on)
+//               : slabBase - start of the memory the slabs are allocated from
+//               : slabIndexShift - log2 of the size of the chunks slabIndex is kept for
+//               : slabIndexLength - number of entries in slabIndex
 
 struct slab_descriptor_table_struct {
     SDENTRY *headEntry;
+    bool magazines;
+    MAGAZINE* emptyMagazines;
+    unsigned long id;
+    pthread_mutex_t* depotLock;
+    THREADMAGS* threadMagazines;
+    SLABPTR** slabIndex;
+    void* slabBase;
+    int slabIndexShift;
+    size_t slabIndexLength;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : magazine_struct
+// Description   : a stack of free slab objects of one type. objects in a magazine are
+//                  marked SLAB_OBJ_CACHED in their slab's bitmap, which keeps the slab
+//                  from being given back and lets a second free of them be caught
+//
+// Variables     : rounds - number of objects in objs
+//               : objs - the objects, the last one is handed out first
+//               : marks - the bitmap entry of each object in its slab
+//               : next - the next magazine in the same depot list
+
+struct magazine_struct {
+    int rounds;
+    void* objs[MAGAZINE_SIZE];
+    unsigned int* marks[MAGAZINE_SIZE];
+    MAGAZINE* next;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : thread_magazines_struct
+// Description   : the two magazines one thread allocates objects of one type from and
+//                  frees them to. only their thread touches them, so it does without the
+//                  heap's lock until it trades one with the depot
+//
+// Variables     : owner - thread the magazines belong to
+//               : type - size of each object in the magazines, as in its entry
+//               : loaded - magazine objects are taken from and put in
+//               : previous - magazine swapped with loaded when loaded runs full or empty
+//               : next - the next thread's magazines of the same table
+
+struct thread_magazines_struct {
+    pthread_t owner;
+    size_t type;
+    MAGAZINE* loaded;
+    MAGAZINE* previous;
+    THREADMAGS* next;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : arena_chunk_struct
+// Description   : a chunk of memory from the buddy tree that an arena bumps through
+//                  
+//
+// Variables     : node - the buddy tree node holding the chunk's memory
+//               : prev - the chunk that was filled before this one
+
+struct arena_chunk_struct {
+    TREENODE* node;
+    ARENACHUNK* prev;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : arena_struct
+// Description   : a bump pointer allocator over chunks from the buddy tree
+//                  
+//
+// Variables     : current - the chunk being filled, the newest in the chunk list
+//               : bumpPtr - the next free byte in the current chunk
+//               : bumpEnd - the end of the current chunk
+
+struct arena_struct {
+    ARENACHUNK* current;
+    void* bumpPtr;
+    void* bumpEnd;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : movable_struct
+// Description   : an entry in a heap's handle table for memory that compaction may move
+//                  
+//
+// Variables     : ptr - where the memory currently is (NULL if the entry is unused)
+//               : size - number of bytes the user asked for
+//               : pinCount - number of my_pin() calls not yet undone, the memory only moves at 0
+//               : nextFree - index of the next unused entry (-1 for none)
+
+struct movable_struct {
+    void* ptr;
+    size_t size;
+    int pinCount;
+    int nextFree;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : cache_slab_struct
+// Description   : a slab owned by one object cache
+//                  
+//
+// Variables     : slabStartAddr - start of the slab's buddy chunk
+//               : firstObj - the first object, at the cache's alignment
+//               : freeMap - one bit per object, set while the object is free
+//               : freeCount - number of bits set in freeMap
+//               : next - the next slab of the cache, slabs with free objects come first
+
+struct cache_slab_struct {
+    void* slabStartAddr;
+    void* firstObj;
+    unsigned long long freeMap;
+    int freeCount;
+    CACHESLAB* next;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : my_cache_struct
+// Description   : an object cache (my_cache_t in interface.h)
+//                  
+//
+// Variables     : name - name of the cache
+//               : objSize - size of each object, rounded up to align
+//               : align - alignment of each object
+//               : slabSize - size of the buddy chunk of each slab
+//               : ctor - run on every object when its slab is created (or NULL)
+//               : dtor - run on every object when its slab is given back (or NULL)
+//               : heap - heap the slabs come from
+//               : slabs - the head of a linked list of the cache's slabs
+
+struct my_cache_struct {
+    char name[CACHE_NAME_LEN];
+    size_t objSize;
+    size_t align;
+    size_t slabSize;
+    void (*ctor)(void* obj);
+    void (*dtor)(void* obj);
+    MYHEAP* heap;
+    CACHESLAB* slabs;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : stack_bucket_struct
+// Description   : the sampled allocations made from one call stack
+//                  
+//
+// Variables     : pcs - return addresses of the call stack, innermost first
+//               : depth - number of addresses in pcs
+//               : allocObjs, allocBytes - sampled allocations made from the stack so far
+//               : inuseObjs, inuseBytes - sampled allocations from the stack not yet freed
+//               : next - next bucket in the same hash chain
+
+struct stack_bucket_struct {
+    void* pcs[PROFILE_MAX_DEPTH];
+    int depth;
+    long allocObjs;
+    long allocBytes;
+    long inuseObjs;
+    long inuseBytes;
+    STACKBUCKET* next;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : heap_sample_struct
+// Description   : a sampled allocation that has not been freed yet
+//                  
+//
+// Variables     : ptr - address my_malloc() returned
+//               : size - number of bytes the user asked for
+//               : bucket - call stack the allocation was made from
+//               : next - next sample in the same hash chain
+
+struct heap_sample_struct {
+    void* ptr;
+    size_t size;
+    STACKBUCKET* bucket;
+    HEAPSAMPLE* next;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : profiler_struct
+// Description   : sampling heap profiler of a heap. allocations are sampled once every
+//                  sampleInterval bytes on average, at exponentially distributed gaps
+//
+// Variables     : sampleInterval - mean number of bytes between samples
+//               : bytesUntilSample - countdown to the next sample, the only work done
+//                      for an allocation that is not sampled
+//               : rngState - xorshift state drawing the gaps between samples
+//               : stacks - hash table of call stacks that have been sampled
+//               : samples - hash table of sampled allocations that are still live
+//               : liveSamples - number of entries in samples, frees only look them up when not 0
+
+struct profiler_struct {
+    long sampleInterval;
+    long bytesUntilSample;
+    unsigned long rngState;
+    STACKBUCKET* stacks[PROFILE_STACK_BUCKETS];
+    HEAPSAMPLE* samples[PROFILE_SAMPLE_BUCKETS];
+    long liveSamples;
 };
 
 
-BUDDYTREE* init_buddy_tree(int memSize, void *startOfMemory);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : my_heap_struct
+// Description   : an independent allocator instance (my_heap_t in interface.h)
+//                  
+//
+// Variables     : policy - allocation scheme the heap uses
+//               : buddyTree - buddy system tree managing the heap's memory
+//               : sdTable - slab descriptor table of the heap's slabs
+//               : arena - bump allocator of the heap (MALLOC_ARENA only)
+//               : headerless - boolean for whether buddy chunks keep their order in the tree's
+//                      side table instead of a header (MALLOC_BUDDY only)
+//               : mappedRegion - start of the mapping the heap made for its memory (NULL if the caller owns it)
+//               : mappedSize - length of that mapping
+//               : nodeHeaps - one heap per NUMA node that this heap hands requests to (NULL if not NUMA-aware)
+//               : nodeCount - number of heaps in nodeHeaps
+//               : movables - handle table of the heap's movable memory (NULL until first used)
+//               : movableCapacity - number of entries in movables
+//               : freeMovable - index of the first unused entry in movables (-1 for none)
+//               : profiler - sampling heap profiler of the heap (NULL when profiling is off)
+//               : persistent - header of the heap's file-backed region, which holds all of its
+//                      bookkeeping (NULL if the heap's bookkeeping is in buddyTree and sdTable)
+//               : threadSafe - boolean for whether heap calls take lock
+//               : lock - recursive mutex serializing the heap's calls when threadSafe
+//               : shared - boolean for whether other processes use the persistent region too,
+//                      so heap calls also take the region's lock
+//               : lockDepth - number of nested heap calls of this process holding the region's lock
+
+struct my_heap_struct {
+    enum malloc_type policy;
+    BUDDYTREE* buddyTree;
+    SDTABLE* sdTable;
+    ARENA* arena;
+    bool headerless;
+    void* mappedRegion;
+    size_t mappedSize;
+    MYHEAP** nodeHeaps;
+    int nodeCount;
+    MOVABLE* movables;
+    int movableCapacity;
+    int freeMovable;
+    PROFILER* profiler;
+    PREGION* persistent;
+    bool threadSafe;
+    pthread_mutex_t lock;
+    bool shared;
+    int lockDepth;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : persistent_region_struct
+// Description   : header at the start of a file-backed region. everything else the heap
+//                  needs is in the region too, and is found by offset from this header, so
+//                  the region works wherever the file is mapped. the buddy system is an
+//                  implicit tree of one byte per node (children of node i are 2i+1 and 2i+2),
+//                  holding 1 + the order of the biggest free chunk below the node, 0 if none
+//
+// Variables     : magic - PERSIST_MAGIC once the region is formatted
+//               : version - PERSIST_VERSION of the layout
+//               : initState - PERSIST_UNINITIALIZED, PERSIST_INITIALIZING while a process
+//                      formats the region, PERSIST_READY once it is formatted
+//               : lock - futex word serializing the calls of every process sharing the
+//                      region: 0 unlocked, 1 locked, 2 locked with waiters
+//               : policy - enum malloc_type of the heap
+//               : regionSize - number of bytes in the region, a power of two
+//               : minOrder - log base 2 of the smallest chunk
+//               : maxOrder - log base 2 of regionSize
+//               : objsPerSlab - number of objects in each slab
+//               : reserved - 0, keeps the offsets 8 byte aligned
+//               : treeOffset - offset of the implicit buddy tree
+//               : slabs - offset of the first slab of a doubly linked list of them (0 for none)
+//               : root - offset of the program's root object (0 for none)
+
+struct persistent_region_struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t initState;
+    uint32_t lock;
+    uint32_t policy;
+    uint64_t regionSize;
+    uint32_t minOrder;
+    uint32_t maxOrder;
+    uint32_t objsPerSlab;
+    uint32_t reserved;
+    uint64_t treeOffset;
+    uint64_t slabs;
+    uint64_t root;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Structure     : persistent_slab_struct
+// Description   : header at the start of every slab of a file-backed region. the slab's
+//                  objects follow it, with no header of their own
+//
+// Variables     : next, prev - offsets of the neighbouring slabs in the region's list (0 for none)
+//               : objSize - size of each object in the slab
+//               : freeCount - number of free objects in the slab
+//               : freeMap - one bit per object, set while the object is free
+
+struct persistent_slab_struct {
+    uint64_t next;
+    uint64_t prev;
+    uint32_t objSize;
+    uint32_t freeCount;
+    uint64_t freeMap;
+};
+
+
+BUDDYTREE* init_buddy_tree(size_t memSize, void *startOfMemory);
     // initializes a buddy system tree
 
-SDENTRY* init_sd_entry(void* newSlabStartAddr, int type);
+void destroy_buddy_tree(BUDDYTREE* buddyTree);
+    // frees every node of a buddy system tree and the tree itself
+
+void destroy_sd_table(SDTABLE* sdTable);
+    // frees every entry and slab of a slab descriptor table and the table itself
+
+SDENTRY* init_sd_entry(void* newSlabStartAddr, size_t type, int objsPerSlab);
     // initializes a slab descriptor entry for given type
 
 SDTABLE* init_sd_table();
     // initializes a slab descriptor table
 
-SDENTRY* sd_table_search(SDTABLE* sdTable, int type);
+SDENTRY* sd_table_search(SDTABLE* sdTable, size_t type);
     // finds entry in table for given type, returns NULL if no entry exists
 
 void sd_table_insert(SDTABLE* sdTable, SDENTRY* entry);
@@ -125,37 +603,196 @@ void sd_table_insert(SDTABLE* sdTable, SDENTRY* entry);
 void sd_table_delete(SDTABLE* sdTable, SDENTRY* entry);
     // deletes an entry from the slab descriptor table
     
-void* add_new_memory_to_slab(SDENTRY* entry);
+void* add_new_memory_to_slab(SDENTRY* entry, int headerSize);
     // returns the address to the first available hole in a slab, returns null if none available
 
-void put_size_in_header(void* startMemBlockAddr, int size);
+void put_size_in_header(void* startMemBlockAddr, size_t size, int headerSize);
     // stores the size of the memory block in the header
 
-int get_size_in_header(void* startMemBlockAddr);
+size_t get_size_in_header(void* startMemBlockAddr, int headerSize);
     // returns the size of given memory block
 
-void add_slab_to_entry(SDENTRY* entry, void* startAddr);
-    // add a slab_ptr to linked list for given slab entry
+bool header_intact(void* startMemBlockAddr, int headerSize);
+    // checks the canary in the header of given memory block (always true unless hardened)
+
+void report_heap_error(const char* message, void* ptr);
+    // prints a heap error about ptr and aborts
+
+SLABPTR* add_slab_to_entry(SDENTRY* entry, void* startAddr);
+    // add a slab_ptr to linked list for given slab entry, returns the new slab
 
 void remove_slab_from_entry(SDENTRY* entry, SLABPTR* slab);
     // removes a slab from an entry in the slab descriptor table
 
-TREENODE* create_new_memory_node(BUDDYTREE* buddyTree, int chunkSize);
+TREENODE* create_new_memory_node(BUDDYTREE* buddyTree, size_t chunkSize, enum lifetime_hint lifetime);
     // creates a new node in the tree containing chunkSize memory
 
-TREENODE* find_placement_node(TREENODE* node, int chunkSize);
+TREENODE* find_placement_node(TREENODE* node, size_t chunkSize);
     // finds the smallest leftmost hole that is greater than or equal to requested size
 
-TREENODE* split_node(TREENODE* node, int chunkSize);
+TREENODE* find_touched_placement_node(BUDDYTREE* buddyTree, TREENODE* node, size_t chunkSize);
+    // same as find_placement_node but only holes starting in an already touched huge page
+
+TREENODE* find_class_placement_node(BUDDYTREE* buddyTree, TREENODE* node, size_t chunkSize, int sizeClass);
+    // same as find_placement_node but only holes in regions claimed by the given class
+
+void init_region_classes(BUDDYTREE* buddyTree);
+    // turns on segregated placement for the tree
+
+void measure_free_holes(TREENODE* node, size_t* totalFree, size_t* largestFree);
+    // adds up the free memory below node and finds the biggest hole
+
+void init_touched_pages(BUDDYTREE* buddyTree);
+    // turns on TLB-aware placement for the tree
+
+void* map_region(size_t memSize, enum hugepage_mode mode, void** mappedRegion, size_t* mappedSize);
+    // maps memSize bytes aligned to a huge page, backed by huge pages when possible
+
+int numa_node_count();
+    // returns the number of NUMA nodes on the machine, 1 if it cannot be found out
+
+int current_numa_node();
+    // returns the NUMA node the calling thread is running on
+
+void bind_to_numa_node(void* startAddr, size_t size, int node);
+    // binds the pages of the given memory to a NUMA node
+
+TREENODE* split_node(TREENODE* node, size_t chunkSize);
     // splits a hole until there is a hole of given size
 
 TREENODE* find_node_by_address(TREENODE* node, void *ptr);
     // find the corresponding tree node given its start address
 
-void check_for_merge(TREENODE* node, int memSize);
+ARENA* init_arena();
+    // initializes an arena with no chunks
+
+void* arena_add_chunk(ARENA* arena, BUDDYTREE* buddyTree, size_t size);
+    // gets a new chunk for the arena and allocates size bytes from it
+
+void arena_rewind(ARENA* arena, BUDDYTREE* buddyTree, PROFILER* profiler, ARENACHUNK* chunk, void* position);
+    // gives back every chunk newer than chunk and moves the bump pointer back to position, ignores a stale mark
+
+void destroy_arena(ARENA* arena);
+    // frees the arena's bookkeeping
+
+void init_order_side_table(BUDDYTREE* buddyTree, int minChunkSize);
+    // creates the table that keeps the order of header-less chunks
+
+void set_chunk_order(BUDDYTREE* buddyTree, void* chunkAddr, int order);
+    // records the order of the chunk starting at chunkAddr (0 when it is freed)
+
+int get_chunk_order(BUDDYTREE* buddyTree, void* chunkAddr);
+    // returns the order of the chunk starting at chunkAddr
+
+void check_for_merge(TREENODE* node, size_t memSize);
     // if both childs of the node are holes, remove the children and set itself as a hole
 
-int next_power_of_two(int num);
+void release_memory_node(BUDDYTREE* buddyTree, TREENODE* node);
+    // turns a memory node back into a hole, merging it now or deferring the merge
+
+void coalesce_holes(TREENODE* node);
+    // merges every pair of buddy holes below the given node
+
+void coalesce_tree(BUDDYTREE* buddyTree);
+    // runs every deferred merge of the tree and frees up the classes of emptied regions
+
+long release_idle_holes(BUDDYTREE* buddyTree, TREENODE* node);
+    // hands the pages of holes that stayed free long enough back to the OS
+
+void init_order_table();
+    // fills in the lookup table of orders for small sizes
+
+int size_to_order(size_t size);
+    // returns the order of the smallest power of two greater than or equal to given number
+
+size_t next_power_of_two(size_t num, size_t minChunkSize);
     // returns a power of two greater than or equal to given number
 
+void* magazine_alloc(SDTABLE* sdTable, size_t size, int headerSize);
+    // takes an object from the thread's magazines of its type, returns NULL if there is none
+
+void magazine_free(SDTABLE* sdTable, size_t type, void* ptr, unsigned int* mark);
+    // puts a freed object in the thread's magazines of its type, trading them with the depot when full
+
+MAGAZINE* detach_magazines(SDENTRY* entry);
+    // takes the depot of full magazines off an entry
+
+bool index_slabs(SDTABLE* sdTable, BUDDYTREE* buddyTree, int minChunkSize);
+    // starts the index of the table's slabs, returns false if it could not be mapped
+
+void set_slab_index(SDTABLE* sdTable, void* slabStartAddr, SLABPTR* slab);
+    // records the slab starting at slabStartAddr (NULL for none) in the table's slab index
+
+SLABPTR* slab_at(SDTABLE* sdTable, void* slabStartAddr);
+    // returns the slab the table's index has starting at slabStartAddr, NULL for none
+
+CACHESLAB* cache_grow(MYCACHE* cache, BUDDYTREE* buddyTree);
+    // gets a new slab for the cache from the buddy tree and constructs its objects
+
+void* cache_alloc_object(MYCACHE* cache, BUDDYTREE* buddyTree);
+    // takes a constructed object from the cache's slabs, growing the cache when they are full
+
+void cache_free_object(MYCACHE* cache, BUDDYTREE* buddyTree, void* obj);
+    // gives an object back to its slab, and the slab back to the tree once it is empty
+
+void cache_release_slab(MYCACHE* cache, BUDDYTREE* buddyTree, CACHESLAB* slab);
+    // destructs the objects of a slab and gives its chunk back to the buddy tree
+
+PROFILER* init_profiler(long sampleInterval);
+    // initializes a sampling heap profiler with no samples
+
+void destroy_profiler(PROFILER* profiler);
+    // frees every stack and sample of a profiler and the profiler itself
+
+void record_sample(PROFILER* profiler, void* ptr, size_t size);
+    // records the call stack of a sampled allocation and draws the gap to the next sample
+
+void forget_sample(PROFILER* profiler, void* ptr);
+    // removes a freed allocation from the live samples, if it was sampled
+
+void forget_samples_between(PROFILER* profiler, void* start, void* end);
+    // removes every live sample in a range of memory released in bulk
+
+void write_heap_profile(FILE* file, PROFILER** profilers, int profilerCount);
+    // writes the samples of the profilers as one heap_v2 profile
+
+PREGION* format_persistent_region(void* startOfMemory, size_t memSize, enum malloc_type type, int minChunkSize, int objsPerSlab);
+    // lays out an empty heap in a region, returns NULL if the region cannot hold one
+
+PREGION* open_persistent_region(void* startOfMemory, size_t memSize, enum malloc_type type);
+    // checks that a region already holds a heap of the given type and size, returns NULL if not
+
+PREGION* attach_persistent_region(void* startOfMemory, size_t memSize, enum malloc_type type, int minChunkSize, int objsPerSlab, bool mayFormat);
+    // opens the heap in a region, formatting it first if no process has yet
+
+void lock_persistent_region(PREGION* region);
+    // takes the lock shared by every process mapping the region
+
+void unlock_persistent_region(PREGION* region);
+    // drops the lock shared by every process mapping the region
+
+uint64_t persistent_alloc_chunk(PREGION* region, int order);
+    // takes the leftmost free chunk of the given order, returns its offset (0 if there is none)
+
+uint64_t persistent_find_chunk(PREGION* region, uint64_t offset, int* order);
+    // returns the offset and order of the allocated chunk holding offset (0 if none does)
+
+void persistent_free_chunk(PREGION* region, uint64_t chunkOffset, int order);
+    // frees an allocated chunk and merges it with its free buddies
+
+void* persistent_buddy_malloc(PREGION* region, size_t size);
+    // allocates a chunk of at least size bytes from a file-backed region
+
+void persistent_buddy_free(PREGION* region, void* ptr);
+    // gives a chunk from persistent_buddy_malloc back to its region
+
+void* persistent_slab_malloc(PREGION* region, size_t size);
+    // allocates an object of given size from the slabs of a file-backed region
+
+void persistent_slab_free(PREGION* region, void* ptr);
+    // gives an object from persistent_slab_malloc back to its slab
+
+void measure_persistent_holes(PREGION* region, size_t* totalFree, size_t* largestFree);
+    // adds up the free memory of a file-backed region and finds its biggest hole
+
 #endif
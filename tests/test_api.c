@@ -0,0 +1,982 @@
+// Behavior tests of the allocator's APIs, beyond what the sample traces cover.
+// Built twice by make test, as is and with -DMY_HARDENED.
+
+#define _GNU_SOURCE
+#include "../interface.h"
+#include "../my_memory.h"
+#include "../my_allocator.h"
+
+#include <sys/wait.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+// Size of the region most tests set a heap up over
+#define TEST_MEMORY_SIZE (1024 * 1024)
+
+// Number of failed checks so far
+static int failures = 0;
+
+// Counts a failed check and reports where it was
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, \
+                    __func__, #cond);                                            \
+            failures++;                                                          \
+        }                                                                        \
+    } while (0)
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : aborts
+// Description  : runs a function in a child process
+//
+//
+// Inputs       : fn - function to run
+// Outputs      : true if the child was killed by SIGABRT
+
+static bool aborts(void (*fn)(void))
+{
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0){
+        // keep the expected heap error report out of the test output
+        freopen("/dev/null", "w", stderr);
+        fn();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && (WTERMSIG(status) == SIGABRT);
+}
+
+
+// Lazy coalescing leaves freed buddies unmerged, until an allocation needs them merged
+static void test_lazy_coalescing(void)
+{
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_setup(MALLOC_BUDDY, TEST_MEMORY_SIZE, RAM);
+    my_set_lazy_coalescing(true, 0);
+
+    void* a = my_malloc(1000);
+    void* b = my_malloc(1000);
+    CHECK((a != NULL) && (b != NULL));
+    my_free(a);
+    my_free(b);
+    CHECK(my_largest_free_block() < TEST_MEMORY_SIZE);
+
+    // only the whole region fits this, so the deferred merges have to run
+    void* whole = my_malloc(TEST_MEMORY_SIZE - HEADER_SIZE);
+    CHECK(whole != NULL);
+    my_free(whole);
+
+    // eager mode again merges straight away
+    my_set_lazy_coalescing(false, 0);
+    a = my_malloc(1000);
+    my_free(a);
+    CHECK(my_largest_free_block() == TEST_MEMORY_SIZE);
+
+    // with a watermark, the merges run once that many frees are put off
+    my_set_lazy_coalescing(true, 2);
+    a = my_malloc(1000);
+    b = my_malloc(1000);
+    my_free(a);
+    CHECK(my_largest_free_block() < TEST_MEMORY_SIZE);
+    my_free(b);
+    CHECK(my_largest_free_block() == TEST_MEMORY_SIZE);
+    free(RAM);
+}
+
+
+// Orders come from the lookup table for small sizes and from clz above it
+static void test_size_to_order(void)
+{
+    init_order_table();
+    CHECK(size_to_order(1) == 0);
+    CHECK(size_to_order(2) == 1);
+    CHECK(size_to_order(513) == 10);
+    CHECK(size_to_order(SMALL_ORDER_TABLE_SIZE) == 12);
+    CHECK(size_to_order(SMALL_ORDER_TABLE_SIZE + 1) == 13);
+    CHECK(size_to_order((size_t)1 << 40) == 40);
+    CHECK(size_to_order(((size_t)1 << 40) + 1) == 41);
+    CHECK(next_power_of_two(1, 512) == 512);
+    CHECK(next_power_of_two(520, 512) == 1024);
+
+    // frees walk down to the chunk by address alone
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    BUDDYTREE* buddyTree = init_buddy_tree(TEST_MEMORY_SIZE, RAM);
+    TREENODE* small = create_new_memory_node(buddyTree, 512, LIFETIME_DEFAULT);
+    TREENODE* large = create_new_memory_node(buddyTree, 64 * 1024, LIFETIME_DEFAULT);
+    CHECK(find_node_by_address(buddyTree->root, small->startAddr) == small);
+    CHECK(find_node_by_address(buddyTree->root, large->startAddr) == large);
+    CHECK(find_node_by_address(buddyTree->root, large->startAddr + 512) == NULL);
+    destroy_buddy_tree(buddyTree);
+    free(RAM);
+}
+
+
+MY_ALLOCATOR_DEFINE(test_buddy, MALLOC_BUDDY, 8, 512, 64)
+MY_ALLOCATOR_DEFINE(test_pool, MALLOC_SLAB, 16, 256, 32)
+
+// Allocators stamped out by MY_ALLOCATOR_DEFINE use their own geometry
+static void test_allocator_define(void)
+{
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    test_buddy_setup(TEST_MEMORY_SIZE, RAM);
+    void* a = test_buddy_malloc(100);
+    void* b = test_buddy_malloc(100);
+    CHECK((a == RAM + 8) && (b == RAM + 512 + 8));
+    test_buddy_free(a);
+    CHECK(test_buddy_malloc(100) == a);
+
+    // slab objects have a 16 byte header, and the slab one more in front of them
+    void* poolRAM = malloc(TEST_MEMORY_SIZE);
+    test_pool_setup(TEST_MEMORY_SIZE, poolRAM);
+    void* x = test_pool_malloc(48);
+    void* y = test_pool_malloc(48);
+    CHECK((x == poolRAM + 32) && (y == x + 64));
+    test_pool_free(x);
+    CHECK(test_pool_malloc(48) == x);
+    free(RAM);
+    free(poolRAM);
+}
+
+
+// Heaps are independent, each over its own region
+static void test_heap_instances(void)
+{
+    void* RAM1 = malloc(TEST_MEMORY_SIZE);
+    void* RAM2 = malloc(TEST_MEMORY_SIZE);
+    my_heap_t* buddyHeap = my_heap_create(MALLOC_BUDDY, TEST_MEMORY_SIZE, RAM1);
+    my_heap_t* slabHeap = my_heap_create(MALLOC_SLAB, TEST_MEMORY_SIZE, RAM2);
+
+    void* a = my_heap_malloc(buddyHeap, 100);
+    void* b = my_heap_malloc(slabHeap, 100);
+    CHECK((a >= RAM1) && (a < RAM1 + TEST_MEMORY_SIZE));
+    CHECK((b >= RAM2) && (b < RAM2 + TEST_MEMORY_SIZE));
+    CHECK(my_heap_largest_free_block(buddyHeap) == TEST_MEMORY_SIZE / 2);
+
+    // freeing in one heap leaves the other as it was
+    my_heap_free(buddyHeap, a);
+    CHECK(my_heap_largest_free_block(buddyHeap) == TEST_MEMORY_SIZE);
+    CHECK(my_heap_largest_free_block(slabHeap) < TEST_MEMORY_SIZE);
+    CHECK(my_heap_malloc(buddyHeap, TEST_MEMORY_SIZE) == NULL);
+
+    my_heap_destroy(buddyHeap);
+    my_heap_destroy(slabHeap);
+    free(RAM1);
+    free(RAM2);
+}
+
+
+// Reads the in use totals from the first line of a heap profile
+static bool read_profile_inuse(const char* path, long* inuseObjs, long* inuseBytes)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL){
+        return false;
+    }
+    bool matched = (fscanf(file, "heap profile: %ld: %ld", inuseObjs, inuseBytes) == 2);
+    fclose(file);
+    return matched;
+}
+
+
+// Rewinding to a stale mark, one from before the arena was reset
+static void rewind_stale_mark(void)
+{
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_heap_t* heap = my_heap_create(MALLOC_ARENA, TEST_MEMORY_SIZE, RAM);
+    my_heap_malloc(heap, 100);
+    my_arena_mark_t mark = my_heap_arena_mark(heap);
+    my_heap_arena_reset(heap);
+    my_heap_arena_rewind(heap, mark);
+    my_heap_destroy(heap);
+    free(RAM);
+}
+
+
+// Arenas bump through chunks and release them in bulk, by reset or by rewinding to a mark
+static void test_arena(void)
+{
+    // an empty request gets a slot of its own, on a new arena and on a full chunk
+    void* zeroRAM = malloc(TEST_MEMORY_SIZE);
+    my_heap_t* zeroHeap = my_heap_create(MALLOC_ARENA, TEST_MEMORY_SIZE, zeroRAM);
+    CHECK(my_heap_malloc(zeroHeap, 0) == zeroRAM);
+    my_heap_arena_reset(zeroHeap);
+    CHECK(my_heap_malloc(zeroHeap, ARENA_CHUNK_SIZE) == zeroRAM);
+    void* empty = my_heap_malloc(zeroHeap, 0);
+    void* next = my_heap_malloc(zeroHeap, 8);
+    CHECK((empty != NULL) && (next != NULL) && (empty != next));
+    my_heap_destroy(zeroHeap);
+    free(zeroRAM);
+
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_setup(MALLOC_ARENA, TEST_MEMORY_SIZE, RAM);
+    my_set_heap_profiling(1);
+
+    void* a = my_malloc(10);
+    void* b = my_malloc(10);
+    CHECK((a == RAM) && (b == RAM + 16));
+    my_free(a);
+    CHECK(my_malloc(10) == RAM + 32);
+
+    // a mark in the first chunk, then enough to fill it and start another
+    my_arena_mark_t mark = my_arena_mark();
+    void* big = my_malloc(ARENA_CHUNK_SIZE);
+    CHECK(big == RAM + ARENA_CHUNK_SIZE);
+    my_arena_rewind(mark);
+    CHECK(my_malloc(10) == RAM + 48);
+    CHECK(my_largest_free_block() == TEST_MEMORY_SIZE / 2);
+
+    // nothing released by a rewind or reset is left in the profile, with an interval of
+    // 1 byte nearly every allocation is sampled
+    long inuseObjs, inuseBytes;
+    CHECK(my_dump_heap_profile("/tmp/test_api_arena.heap"));
+    CHECK(read_profile_inuse("/tmp/test_api_arena.heap", &inuseObjs, &inuseBytes));
+    // a was given to my_free(), at most the other three are still in use
+    CHECK((inuseObjs <= 3) && (inuseBytes <= 30));
+    my_arena_reset();
+    CHECK(my_dump_heap_profile("/tmp/test_api_arena.heap"));
+    CHECK(read_profile_inuse("/tmp/test_api_arena.heap", &inuseObjs, &inuseBytes));
+    CHECK((inuseObjs == 0) && (inuseBytes == 0));
+    unlink("/tmp/test_api_arena.heap");
+    CHECK(my_largest_free_block() == TEST_MEMORY_SIZE);
+
+    // a mark from past the bump pointer of the chunk being filled is stale too
+    my_malloc(10);
+    my_arena_mark_t later = my_arena_mark();
+    my_arena_reset();
+    my_malloc(10);
+    my_arena_rewind(later);
+    CHECK(my_malloc(10) == RAM + 16);
+    my_set_heap_profiling(0);
+    free(RAM);
+
+#ifdef MY_HARDENED
+    CHECK(aborts(rewind_stale_mark));
+#else
+    CHECK(!aborts(rewind_stale_mark));
+#endif
+}
+
+
+// Freeing a header-less chunk twice
+static void headerless_double_free(void)
+{
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_heap_t* heap = my_heap_create(MALLOC_BUDDY, TEST_MEMORY_SIZE, RAM);
+    my_heap_set_headerless(heap, true);
+    void* a = my_heap_malloc(heap, 512);
+    my_heap_free(heap, a);
+    my_heap_free(heap, a);
+    my_heap_destroy(heap);
+    free(RAM);
+}
+
+
+// Header-less chunks keep their order in the side table, so a power of two fits exactly
+static void test_headerless(void)
+{
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_heap_t* heap = my_heap_create(MALLOC_BUDDY, TEST_MEMORY_SIZE, RAM);
+    my_heap_set_headerless(heap, true);
+
+    void* a = my_heap_malloc(heap, 512);
+    void* b = my_heap_malloc(heap, 512);
+    void* c = my_heap_malloc(heap, 4096);
+    CHECK((a == RAM) && (b == RAM + 512) && (c == RAM + 4096));
+    CHECK(get_chunk_order(heap->buddyTree, c) == 12);
+
+    // frees take the order from the table, and a pointer with no entry is left alone
+    my_heap_free(heap, c);
+    CHECK(get_chunk_order(heap->buddyTree, c) == 0);
+#ifndef MY_HARDENED
+    my_heap_free(heap, c);
+    my_heap_free(heap, b + 8);
+#endif
+    my_heap_free(heap, a);
+    my_heap_free(heap, b);
+    CHECK(my_heap_largest_free_block(heap) == TEST_MEMORY_SIZE);
+    my_heap_destroy(heap);
+    free(RAM);
+
+#ifdef MY_HARDENED
+    CHECK(aborts(headerless_double_free));
+#else
+    CHECK(!aborts(headerless_double_free));
+#endif
+}
+
+
+// Heaps over their own huge page aligned mapping place small chunks in touched pages first
+static void test_hugepage(void)
+{
+    size_t memSize = 4 * HUGE_PAGE_SIZE;
+    my_heap_t* heap = my_heap_create_hugepage(MALLOC_BUDDY, memSize, HUGEPAGE_MADVISE);
+    CHECK(heap != NULL);
+    void* start = heap->buddyTree->root->startAddr;
+    CHECK(((uintptr_t)start & (HUGE_PAGE_SIZE - 1)) == 0);
+
+    // every huge page a chunk covers is marked touched, and stays so after it is freed
+    void* page = my_heap_malloc(heap, HUGE_PAGE_SIZE - HEADER_SIZE);
+    void* small = my_heap_malloc(heap, 100);
+    CHECK((page == start + HEADER_SIZE) && (small == start + HUGE_PAGE_SIZE + HEADER_SIZE));
+    my_heap_free(heap, page);
+    CHECK(heap->buddyTree->touchedPages[0] && heap->buddyTree->touchedPages[1] && !heap->buddyTree->touchedPages[2]);
+
+    // the next small chunk goes next to the first one, in the touched pages
+    void* next = my_heap_malloc(heap, 100);
+    CHECK(next == small + MIN_MEM_CHUNK_SIZE);
+    CHECK(!heap->buddyTree->touchedPages[2] && !heap->buddyTree->touchedPages[3]);
+    my_heap_destroy(heap);
+
+    // mem_size need not be a multiple of a huge page
+    heap = my_heap_create_hugepage(MALLOC_SLAB, TEST_MEMORY_SIZE, HUGEPAGE_NONE);
+    CHECK((heap != NULL) && (my_heap_malloc(heap, 100) != NULL));
+    my_heap_destroy(heap);
+}
+
+
+// NUMA-aware heaps split the region between per-node heaps (a plain heap on one node)
+static void test_numa(void)
+{
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_heap_t* heap = my_heap_create_numa(MALLOC_BUDDY, TEST_MEMORY_SIZE, RAM);
+    int nodeCount = numa_node_count();
+    CHECK((nodeCount == 1) ? (heap->nodeHeaps == NULL) : (heap->nodeCount == nodeCount));
+
+    // memory for a given node comes from that node's part of the region
+    void* a = my_heap_malloc_node(heap, 100, nodeCount - 1);
+    CHECK(a != NULL);
+    if (heap->nodeHeaps != NULL){
+        CHECK(a >= heap->nodeHeaps[nodeCount - 1]->buddyTree->root->startAddr);
+        CHECK(my_heap_malloc_node(heap, 100, nodeCount) == NULL);
+    }
+    void* b = my_heap_malloc(heap, 100);
+    my_heap_free(heap, a);
+    my_heap_free(heap, b);
+    CHECK(my_heap_fragmentation_index(heap) == 0.0);
+    my_heap_destroy(heap);
+
+    // a region too small to give every node a chunk stays one heap
+    heap = my_heap_create_numa(MALLOC_BUDDY, MIN_MEM_CHUNK_SIZE, RAM);
+    CHECK(heap->nodeHeaps == NULL);
+    CHECK(my_heap_malloc(heap, 8) == RAM + HEADER_SIZE);
+    my_heap_destroy(heap);
+    free(RAM);
+}
+
+
+// Decay hands the pages of long free holes back to the OS
+static void test_decay(void)
+{
+    my_heap_t* heap = my_heap_create_hugepage(MALLOC_BUDDY, TEST_MEMORY_SIZE, HUGEPAGE_NONE);
+    char* a = my_heap_malloc(heap, 256 * 1024);
+    memset(a, 0x5A, 256 * 1024);
+    my_heap_free(heap, a);
+
+    // with decay off a manual pass releases every free hole, once
+    CHECK(my_heap_release_idle_memory(heap) == TEST_MEMORY_SIZE);
+    CHECK(my_heap_release_idle_memory(heap) == 0);
+    CHECK(a[100] == 0);
+
+    // with decay on, a pass runs every idle_ops operations and releases what stayed free
+    my_heap_set_decay(heap, 4, false);
+    a = my_heap_malloc(heap, 256 * 1024);
+    memset(a, 0x5A, 256 * 1024);
+    my_heap_free(heap, a);
+    void* smalls[8];
+    for (int i = 0; i < 8; i++){
+        smalls[i] = my_heap_malloc(heap, 100);
+    }
+    CHECK(a[128 * 1024] == 0);
+    for (int i = 0; i < 8; i++){
+        my_heap_free(heap, smalls[i]);
+    }
+    my_heap_destroy(heap);
+}
+
+
+// Segregated placement keeps size bands and lifetimes in separate regions
+static void test_segregated_placement(void)
+{
+    size_t memSize = 8 * 1024 * 1024;
+    void* RAM = malloc(memSize);
+    my_heap_t* heap = my_heap_create(MALLOC_BUDDY, memSize, RAM);
+    my_heap_set_segregated_placement(heap, true);
+    signed char* regionClasses = heap->buddyTree->regionClasses;
+    CHECK(heap->buddyTree->regionSize == 1024 * 1024);
+
+    void* shortLived = my_heap_malloc_hint(heap, 100, LIFETIME_SHORT);
+    void* longLived = my_heap_malloc_hint(heap, 100, LIFETIME_LONG);
+    void* big = my_heap_malloc_hint(heap, 8192, LIFETIME_SHORT);
+    CHECK((shortLived == RAM + HEADER_SIZE) && (longLived == RAM + 1024 * 1024 + HEADER_SIZE) && (big == RAM + 2 * 1024 * 1024 + HEADER_SIZE));
+    CHECK((regionClasses[0] == 1) && (regionClasses[1] == 2) && (regionClasses[2] == 4));
+
+    // a region that is wholly free again is no longer held for its old class
+    my_heap_free(heap, longLived);
+    CHECK(regionClasses[1] == -1);
+    CHECK(my_heap_malloc_hint(heap, 8192, LIFETIME_LONG) == RAM + 1024 * 1024 + HEADER_SIZE);
+    CHECK(regionClasses[1] == 5);
+
+    // with lazy coalescing, once the put off merges are done
+    my_heap_set_lazy_coalescing(heap, true, 0);
+    my_heap_free(heap, big);
+    CHECK(regionClasses[2] == 4);
+    my_heap_set_lazy_coalescing(heap, false, 0);
+    CHECK(regionClasses[2] == -1);
+
+    my_heap_free(heap, shortLived);
+    CHECK(my_heap_fragmentation_index(heap) > 0.0);
+    my_heap_destroy(heap);
+    free(RAM);
+}
+
+
+// Movable memory is reached through handles, and compaction moves what is not pinned
+static void test_movable(void)
+{
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_setup(MALLOC_BUDDY, TEST_MEMORY_SIZE, RAM);
+    CHECK(my_compact(TEST_MEMORY_SIZE) == 0);
+
+    void* low = my_malloc(1000);
+    my_handle_t pinned = my_malloc_movable(1000);
+    my_handle_t moving = my_malloc_movable(1000);
+    CHECK((pinned != 0) && (moving != 0) && (pinned != moving));
+    char* pinnedAddr = my_pin(pinned);
+    char* movingAddr = my_pin(moving);
+    strcpy(movingAddr, "moved");
+    my_unpin(moving);
+    CHECK(my_pin(0) == NULL);
+    CHECK(my_pin(moving + 100) == NULL);
+
+    // with a hole below them, only the unpinned one moves into it
+    my_free(low);
+    CHECK(my_compact(TEST_MEMORY_SIZE) == 1000);
+    CHECK(my_pin(pinned) == pinnedAddr);
+    char* newAddr = my_pin(moving);
+    CHECK((newAddr == RAM + HEADER_SIZE) && (strcmp(newAddr, "moved") == 0));
+    my_unpin(moving);
+
+    my_unpin(pinned);
+    my_unpin(pinned);
+    my_free_movable(pinned);
+    my_free_movable(moving);
+    CHECK(my_pin(moving) == NULL);
+    CHECK(my_largest_free_block() == TEST_MEMORY_SIZE);
+    free(RAM);
+}
+
+
+// Reads the totals line of a heap profile and checks the file has the memory map pprof needs
+static bool read_profile_totals(const char* path, long totals[4], long* interval)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL){
+        return false;
+    }
+    bool matched = (fscanf(file, "heap profile: %ld: %ld [%ld: %ld] @ heap_v2/%ld",
+                           &totals[0], &totals[1], &totals[2], &totals[3], interval) == 5);
+    bool mapped = false;
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL){
+        mapped = mapped || (strcmp(line, "MAPPED_LIBRARIES:\n") == 0);
+    }
+    fclose(file);
+    return matched && mapped;
+}
+
+
+// The profiler samples allocations, forgets freed ones and writes a heap_v2 profile
+static void test_heap_profiling(void)
+{
+    const char* path = "/tmp/test_api_profile.heap";
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_heap_t* heap = my_heap_create(MALLOC_BUDDY, TEST_MEMORY_SIZE, RAM);
+    CHECK(!my_heap_dump_heap_profile(heap, path));
+
+    // with an interval of 1 byte every allocation of 100 bytes is sampled
+    my_heap_set_heap_profiling(heap, 1);
+    void* blocks[10];
+    for (int i = 0; i < 10; i++){
+        blocks[i] = my_heap_malloc(heap, 100);
+    }
+    for (int i = 0; i < 4; i++){
+        my_heap_free(heap, blocks[i]);
+    }
+
+    long totals[4];
+    long interval = 0;
+    CHECK(my_heap_dump_heap_profile(heap, path));
+    CHECK(read_profile_totals(path, totals, &interval));
+    CHECK((totals[0] == 6) && (totals[1] == 600));
+    CHECK((totals[2] == 10) && (totals[3] == 1000));
+    CHECK(interval == 1);
+
+    // a new interval starts a new profile, and 0 turns profiling off
+    my_heap_set_heap_profiling(heap, 1);
+    CHECK(my_heap_dump_heap_profile(heap, path));
+    CHECK(read_profile_totals(path, totals, &interval));
+    CHECK((totals[0] == 0) && (totals[2] == 0));
+    my_heap_set_heap_profiling(heap, 0);
+    CHECK(!my_heap_dump_heap_profile(heap, path));
+    unlink(path);
+
+    for (int i = 4; i < 10; i++){
+        my_heap_free(heap, blocks[i]);
+    }
+    my_heap_destroy(heap);
+    free(RAM);
+}
+
+
+// A file-backed heap keeps its objects and root across a reopen, wherever it is mapped
+static void test_persistent_reopen(void)
+{
+    for (int type = MALLOC_BUDDY; type <= MALLOC_SLAB; type++){
+        FILE* file = tmpfile();
+        int fd = fileno(file);
+        my_heap_t* heap = my_heap_open_file(type, TEST_MEMORY_SIZE, fd);
+        CHECK(heap != NULL);
+        size_t offsets[200];
+        for (int i = 0; i < 200; i++){
+            char* word = my_heap_malloc(heap, 32);
+            snprintf(word, 32, "word %d", i);
+            offsets[i] = my_heap_offset_of(heap, word);
+        }
+        // every other object is freed, so the slabs are both full and partly free
+        for (int i = 0; i < 200; i += 2){
+            my_heap_free(heap, my_heap_ptr_at(heap, offsets[i]));
+        }
+        my_heap_set_root(heap, my_heap_ptr_at(heap, offsets[101]));
+        CHECK(my_heap_sync(heap));
+        my_heap_destroy(heap);
+
+        // the wrong type or size is refused and leaves the file as it is
+        CHECK(my_heap_open_file(1 - type, TEST_MEMORY_SIZE, fd) == NULL);
+        CHECK(my_heap_open_file(type, 2 * TEST_MEMORY_SIZE, fd) == NULL);
+
+        heap = my_heap_open_file(type, TEST_MEMORY_SIZE, fd);
+        CHECK(heap != NULL);
+        char* root = my_heap_get_root(heap);
+        CHECK((root != NULL) && (my_heap_offset_of(heap, root) == offsets[101]) && (strcmp(root, "word 101") == 0));
+        bool kept = true;
+        for (int i = 1; i < 200; i += 2){
+            char expected[32];
+            snprintf(expected, sizeof(expected), "word %d", i);
+            kept = kept && (strcmp(my_heap_ptr_at(heap, offsets[i]), expected) == 0);
+        }
+        CHECK(kept);
+
+        // the objects freed before the reopen are handed out again, the others are not
+        bool reused = true;
+        for (int i = 0; i < 100; i++){
+            size_t offset = my_heap_offset_of(heap, my_heap_malloc(heap, 32));
+            for (int j = 1; j < 200; j += 2){
+                reused = reused && (offset != offsets[j]);
+            }
+        }
+        CHECK(reused);
+        my_heap_destroy(heap);
+        fclose(file);
+    }
+}
+
+
+// Returns a memfd of mem_size bytes holding only the given header bytes
+static int region_file(size_t mem_size, const void* header, size_t headerSize, off_t offset)
+{
+    int fd = memfd_create("test_api", 0);
+    ftruncate(fd, mem_size);
+    if (headerSize > 0){
+        pwrite(fd, header, headerSize, offset);
+    }
+    return fd;
+}
+
+
+// Shared heaps are formatted once by whichever process comes first, and regions that are
+// not zero filled or left initializing are refused without hanging
+static void test_shared_open(void)
+{
+    // two processes open a new region together and hand an object over by its offset
+    int fd = region_file(TEST_MEMORY_SIZE, NULL, 0, 0);
+    pid_t child = fork();
+    if (child == 0){
+        my_heap_t* heap = my_heap_open_shared(MALLOC_SLAB, TEST_MEMORY_SIZE, fd);
+        if (heap == NULL){
+            _exit(1);
+        }
+        char* message = my_heap_malloc(heap, 32);
+        strcpy(message, "from the child");
+        my_heap_set_root(heap, message);
+        _exit(0);
+    }
+    my_heap_t* heap = my_heap_open_shared(MALLOC_SLAB, TEST_MEMORY_SIZE, fd);
+    CHECK(heap != NULL);
+    void* mine = my_heap_malloc(heap, 32);
+    int status;
+    waitpid(child, &status, 0);
+    CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+    char* root = my_heap_get_root(heap);
+    CHECK((root != NULL) && (root != mine) && (strcmp(root, "from the child") == 0));
+    my_heap_destroy(heap);
+    close(fd);
+
+    // data anywhere but the header keeps a region from being formatted over
+    uint64_t magic;
+    char data = 'x';
+    fd = region_file(TEST_MEMORY_SIZE, &data, 1, TEST_MEMORY_SIZE / 2);
+    CHECK(my_heap_open_shared(MALLOC_BUDDY, TEST_MEMORY_SIZE, fd) == NULL);
+    CHECK((pread(fd, &data, 1, TEST_MEMORY_SIZE / 2) == 1) && (data == 'x'));
+    CHECK((pread(fd, &magic, 8, 0) == 8) && (magic == 0));
+    close(fd);
+
+    // a region a process died while formatting is refused at once when not shared, and
+    // after a bounded wait when shared
+    uint32_t initializing = PERSIST_INITIALIZING;
+    fd = region_file(TEST_MEMORY_SIZE, &initializing, sizeof(initializing), offsetof(PREGION, initState));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CHECK(my_heap_open_file(MALLOC_BUDDY, TEST_MEMORY_SIZE, fd) == NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    CHECK(end.tv_sec - start.tv_sec < 1);
+    CHECK(my_heap_open_shared(MALLOC_BUDDY, TEST_MEMORY_SIZE, fd) == NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    CHECK(end.tv_sec - start.tv_sec < 2 * PERSIST_INIT_TIMEOUT_MS / 1000);
+    close(fd);
+}
+
+
+// Slab objects are sized in size_t, so a slab of them may be bigger than an int. Only
+// the headers are touched, so the region is mapped without reserving it
+static void test_large_slab_objects(void)
+{
+    size_t regionSize = (size_t)8 << 30;
+    void* region = mmap(NULL, regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    CHECK(region != MAP_FAILED);
+    if (region == MAP_FAILED){
+        return;
+    }
+    my_heap_t* heap = my_heap_create(MALLOC_SLAB, regionSize, region);
+
+    size_t size = (size_t)64 << 20;
+    char* a = my_heap_malloc(heap, size);
+    char* b = my_heap_malloc(heap, size);
+    CHECK((a != NULL) && (b == a + size + HEADER_SIZE));
+    CHECK(get_size_in_header(b, HEADER_SIZE) == size);
+    CHECK(my_heap_malloc(heap, SIZE_MAX - HEADER_SIZE) == NULL);
+    my_heap_free(heap, a);
+    my_heap_free(heap, b);
+    CHECK(my_heap_largest_free_block(heap) == regionSize);
+
+    my_heap_destroy(heap);
+    munmap(region, regionSize);
+}
+
+
+// Frees an object twice with magazines on
+static void magazine_double_free(void)
+{
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_heap_t* heap = my_heap_create(MALLOC_SLAB, TEST_MEMORY_SIZE, RAM);
+    my_heap_set_magazines(heap, true);
+    void* a = my_heap_malloc(heap, 24);
+    my_heap_free(heap, a);
+    my_heap_free(heap, a);
+}
+
+
+// Magazines cache freed slab objects, but still check every free against the slabs
+static void test_magazines(void)
+{
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_heap_t* heap = my_heap_create(MALLOC_SLAB, TEST_MEMORY_SIZE, RAM);
+    my_heap_set_magazines(heap, true);
+
+    void* objs[100];
+    for (int i = 0; i < 100; i++){
+        objs[i] = my_heap_malloc(heap, 24);
+    }
+    for (int i = 0; i < 100; i++){
+        my_heap_free(heap, objs[i]);
+    }
+    // the most recently freed object comes back first
+    CHECK(my_heap_malloc(heap, 24) == objs[99]);
+    my_heap_free(heap, objs[99]);
+
+#ifndef MY_HARDENED
+    // a second free and a pointer into an object never reach a magazine
+    void* a = my_heap_malloc(heap, 24);
+    my_heap_free(heap, a);
+    my_heap_free(heap, a);
+    my_heap_free(heap, (char*)objs[10] + 4);
+    void* b = my_heap_malloc(heap, 24);
+    void* c = my_heap_malloc(heap, 24);
+    CHECK((b == a) && (c != a) && (c != (char*)objs[10] + 4));
+    my_heap_free(heap, b);
+    my_heap_free(heap, c);
+#endif
+
+    // slabs holding only cached objects go back to the tree once the magazines are off
+    my_heap_set_magazines(heap, false);
+    CHECK(my_heap_largest_free_block(heap) == TEST_MEMORY_SIZE);
+    my_heap_destroy(heap);
+    free(RAM);
+
+#ifdef MY_HARDENED
+    CHECK(aborts(magazine_double_free));
+#else
+    CHECK(!aborts(magazine_double_free));
+#endif
+}
+
+
+// Number of times the object cache test's constructor and destructor ran
+static int constructed;
+static int destructed;
+
+static void count_ctor(void* obj)
+{
+    *(int*)obj = 42;
+    constructed++;
+}
+
+static void count_dtor(void* obj)
+{
+    (void)obj;
+    destructed++;
+}
+
+
+// Object caches hand out aligned objects, construct them once per slab and refuse
+// geometries the heap cannot hold
+static void test_object_cache(void)
+{
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_heap_t* heap = my_heap_create(MALLOC_BUDDY, TEST_MEMORY_SIZE, RAM);
+
+    CHECK(my_heap_cache_create(heap, "empty", 0, 0, NULL, NULL) == NULL);
+    CHECK(my_heap_cache_create(heap, "odd", 24, 3, NULL, NULL) == NULL);
+    CHECK(my_heap_cache_create(heap, "huge", 64 * TEST_MEMORY_SIZE, 0, NULL, NULL) == NULL);
+    CHECK(my_heap_cache_create(heap, "wide", 24, (size_t)1 << 62, NULL, NULL) == NULL);
+    CHECK(my_heap_cache_create(heap, "wrap", SIZE_MAX, 0, NULL, NULL) == NULL);
+    CHECK(my_heap_cache_create(heap, "wrap", SIZE_MAX / CACHE_OBJS_PER_SLAB + 2, 0, NULL, NULL) == NULL);
+
+    my_cache_t* cache = my_heap_cache_create(heap, "objects", 40, 64, count_ctor, count_dtor);
+    CHECK(cache != NULL);
+    int* objs[100];
+    bool distinct = true;
+    for (int i = 0; i < 100; i++){
+        objs[i] = my_cache_alloc(cache);
+        CHECK((objs[i] != NULL) && (((uintptr_t)objs[i] & 63) == 0) && (*objs[i] == 42));
+        for (int j = 0; j < i; j++){
+            distinct = distinct && (objs[i] != objs[j]);
+        }
+    }
+    CHECK(distinct);
+    // 100 objects take two slabs, constructed whole
+    CHECK(constructed == 2 * CACHE_OBJS_PER_SLAB);
+
+    // a freed object comes back in its constructed state
+    my_cache_free(cache, objs[5]);
+    CHECK(my_cache_alloc(cache) == objs[5]);
+    for (int i = 0; i < 100; i++){
+        my_cache_free(cache, objs[i]);
+    }
+    my_cache_destroy(cache);
+    CHECK(destructed == constructed);
+    CHECK(my_heap_largest_free_block(heap) == TEST_MEMORY_SIZE);
+
+    my_heap_destroy(heap);
+    free(RAM);
+}
+
+
+#ifdef MY_HARDENED
+// Overflows one block into the header of the next and frees the next one
+static void overwritten_header_free(void)
+{
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_heap_t* heap = my_heap_create(MALLOC_BUDDY, TEST_MEMORY_SIZE, RAM);
+    char* a = my_heap_malloc(heap, 100);
+    char* b = my_heap_malloc(heap, 100);
+    memset(a, 0x41, b - a);
+    my_heap_free(heap, b);
+}
+
+
+// A hardened build catches a header clobbered by an overflow
+static void test_header_canary(void)
+{
+    void* RAM = malloc(TEST_MEMORY_SIZE);
+    my_heap_t* heap = my_heap_create(MALLOC_BUDDY, TEST_MEMORY_SIZE, RAM);
+    void* a = my_heap_malloc(heap, 100);
+    CHECK(header_intact(a, HEADER_SIZE));
+    my_heap_free(heap, a);
+    my_heap_destroy(heap);
+    free(RAM);
+
+    CHECK(aborts(overwritten_header_free));
+}
+#endif
+
+
+// Number of threads and of allocations per thread in the thread safety test
+#define TEST_THREADS 4
+#define TEST_THREAD_ALLOCS 2000
+
+// Shared by the threads of the thread safety test
+static my_heap_t* threadHeap;
+static void* handedOver[TEST_THREADS][TEST_THREAD_ALLOCS];
+
+
+// Allocates into its own row of handedOver and frees the row of the thread before it
+static void* thread_safety_worker(void* arg)
+{
+    long index = (long)arg;
+    for (int i = 0; i < TEST_THREAD_ALLOCS; i++){
+        handedOver[index][i] = my_heap_malloc(threadHeap, 16 + (i % 5) * 100);
+        my_heap_free_movable(threadHeap, my_heap_malloc_movable(threadHeap, 64));
+    }
+    return NULL;
+}
+
+
+// A thread safe heap takes allocations, frees and handles from any thread
+static void test_thread_safety(void)
+{
+    void* RAM = malloc(16 * TEST_MEMORY_SIZE);
+    my_heap_t* heap = my_heap_create_numa(MALLOC_SLAB, 16 * TEST_MEMORY_SIZE, RAM);
+    my_heap_set_thread_safe(heap, true);
+    CHECK(heap->threadSafe);
+    for (int node = 0; node < heap->nodeCount; node++){
+        CHECK(heap->nodeHeaps[node]->threadSafe);
+    }
+
+    threadHeap = heap;
+    pthread_t threads[TEST_THREADS];
+    for (long i = 0; i < TEST_THREADS; i++){
+        pthread_create(&threads[i], NULL, thread_safety_worker, (void*)i);
+    }
+    for (int i = 0; i < TEST_THREADS; i++){
+        pthread_join(threads[i], NULL);
+    }
+
+    // every object comes back to the heap, freed by another thread than its own
+    for (int i = 0; i < TEST_THREADS; i++){
+        for (int j = 0; j < TEST_THREAD_ALLOCS; j++){
+            CHECK(handedOver[i][j] != NULL);
+        }
+    }
+    for (int i = 0; i < TEST_THREADS; i++){
+        for (int j = 0; j < TEST_THREAD_ALLOCS; j++){
+            my_heap_free(heap, handedOver[(i + 1) % TEST_THREADS][j]);
+        }
+    }
+    CHECK(my_heap_fragmentation_index(heap) == 0.0);
+    my_heap_destroy(heap);
+    free(RAM);
+}
+
+
+
+// Churns objects through the thread's own magazines, then allocates its row of handedOver.
+// Returns non-NULL if a freed object did not come back to the thread that freed it
+static void* thread_magazines_worker(void* arg)
+{
+    long index = (long)arg;
+    void* objs[MAGAZINE_SIZE];
+    void* lost = NULL;
+    for (int round = 0; round < 100; round++){
+        for (int i = 0; i < MAGAZINE_SIZE; i++){
+            objs[i] = my_heap_malloc(threadHeap, 24);
+        }
+        for (int i = 0; i < MAGAZINE_SIZE; i++){
+            my_heap_free(threadHeap, objs[i]);
+        }
+        void* again = my_heap_malloc(threadHeap, 24);
+        if (again != objs[MAGAZINE_SIZE - 1]){
+            lost = again;
+        }
+        my_heap_free(threadHeap, again);
+    }
+    for (int i = 0; i < TEST_THREAD_ALLOCS; i++){
+        handedOver[index][i] = my_heap_malloc(threadHeap, 24 + (i % 3) * 40);
+    }
+    return lost;
+}
+
+
+// Each thread of a thread safe heap has magazines of its own, and objects freed by another
+// thread than their own still get back to their slabs
+static void test_thread_magazines(void)
+{
+    void* RAM = malloc(16 * TEST_MEMORY_SIZE);
+    my_heap_t* heap = my_heap_create(MALLOC_SLAB, 16 * TEST_MEMORY_SIZE, RAM);
+    my_heap_set_thread_safe(heap, true);
+    my_heap_set_magazines(heap, true);
+
+    threadHeap = heap;
+    pthread_t threads[TEST_THREADS];
+    for (long i = 0; i < TEST_THREADS; i++){
+        pthread_create(&threads[i], NULL, thread_magazines_worker, (void*)i);
+    }
+    for (int i = 0; i < TEST_THREADS; i++){
+        void* lost;
+        pthread_join(threads[i], &lost);
+        CHECK(lost == NULL);
+    }
+
+    for (int i = 0; i < TEST_THREADS; i++){
+        for (int j = 0; j < TEST_THREAD_ALLOCS; j++){
+            CHECK(handedOver[i][j] != NULL);
+            my_heap_free(heap, handedOver[i][j]);
+        }
+    }
+
+    // objects in every thread's magazines go back to their slabs once magazines are off
+    my_heap_set_magazines(heap, false);
+    CHECK(my_heap_largest_free_block(heap) == 16 * TEST_MEMORY_SIZE);
+    my_heap_destroy(heap);
+    free(RAM);
+}
+
+
+int main(void)
+{
+    test_lazy_coalescing();
+    test_size_to_order();
+    test_allocator_define();
+    test_heap_instances();
+    test_arena();
+    test_headerless();
+    test_hugepage();
+    test_numa();
+    test_decay();
+    test_segregated_placement();
+    test_movable();
+    test_thread_safety();
+    test_thread_magazines();
+    test_heap_profiling();
+    test_object_cache();
+    test_large_slab_objects();
+    test_magazines();
+    test_persistent_reopen();
+    test_shared_open();
+#ifdef MY_HARDENED
+    test_header_canary();
+#endif
+
+    if (failures > 0){
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
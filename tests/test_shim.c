@@ -0,0 +1,92 @@
+// Run under LD_PRELOAD=./libmyalloc.so by make test: every call here goes through the shim
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of checks that failed
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)){ \
+        fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+#define SHIM_TEST_THREADS 4
+
+
+// Allocates, fills and frees blocks of mixed sizes
+static void* churn(void* arg)
+{
+    (void)arg;
+    void* blocks[256];
+    for (int round = 0; round < 50; round++){
+        for (int i = 0; i < 256; i++){
+            size_t size = 8 + (size_t)((i * 37 + round) % 6000);
+            blocks[i] = malloc(size);
+            memset(blocks[i], i, size);
+        }
+        for (int i = 0; i < 256; i++){
+            free(blocks[i]);
+        }
+    }
+    return NULL;
+}
+
+
+int main(void)
+{
+    // buddy chunks are powers of two, so the usable size shows the shim is in place
+    const char* policy = getenv("MY_ALLOC_POLICY");
+    bool slabs = (policy != NULL) && (strcmp(policy, "slab") == 0);
+    char* a = malloc(100);
+    CHECK(a != NULL);
+    size_t usable = malloc_usable_size(a);
+    CHECK(usable >= 100);
+    CHECK(slabs || ((usable & (usable - 1)) == 0));
+    memset(a, 'x', usable);
+
+    // realloc keeps the contents, calloc clears
+    a = realloc(a, 10000);
+    CHECK((a != NULL) && (a[0] == 'x') && (a[99] == 'x'));
+    free(a);
+    unsigned char* zeroed = calloc(1000, 4);
+    bool allZero = (zeroed != NULL);
+    for (int i = 0; allZero && (i < 4000); i++){
+        allZero = (zeroed[i] == 0);
+    }
+    CHECK(allZero);
+    free(zeroed);
+    volatile size_t hugeCount = SIZE_MAX / 2;
+    CHECK(calloc(hugeCount, 4) == NULL);
+
+    void* aligned = NULL;
+    CHECK(posix_memalign(&aligned, 4096, 100) == 0);
+    CHECK(((uintptr_t)aligned & 4095) == 0);
+    free(aligned);
+    CHECK(posix_memalign(&aligned, 4 * 1024 * 1024, 100) == 0);
+    CHECK(((uintptr_t)aligned & (4 * 1024 * 1024 - 1)) == 0);
+    free(aligned);
+    CHECK(posix_memalign(&aligned, 3, 100) != 0);
+    free(NULL);
+
+    pthread_t threads[SHIM_TEST_THREADS];
+    for (int i = 0; i < SHIM_TEST_THREADS; i++){
+        pthread_create(&threads[i], NULL, churn, NULL);
+    }
+    for (int i = 0; i < SHIM_TEST_THREADS; i++){
+        pthread_join(threads[i], NULL);
+    }
+
+    if (failures != 0){
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all shim tests passed\n");
+    return 0;
+}